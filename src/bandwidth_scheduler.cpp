@@ -0,0 +1,104 @@
+/*****************************************************************************
+ *
+ * Copyright (c) 2018-2020, Oleg `Kanedias` Chernovskiy
+ *
+ * This file is part of MARC-FS.
+ *
+ * MARC-FS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MARC-FS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MARC-FS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+
+#include "bandwidth_scheduler.h"
+
+/**
+ * @brief BURST_TIME - how much of unused rate bucket keeps, expressed in time at full rate
+ */
+static const double BURST_TIME = 0.1;
+
+thread_local static double currentWeight = 1.0;
+
+BandwidthScheduler::Flow::Flow()
+    : weight(currentWeight) {
+}
+
+BandwidthScheduler::Priority::Priority(double weight)
+    : previous(currentWeight) {
+    currentWeight = weight;
+}
+
+BandwidthScheduler::Priority::~Priority() {
+    currentWeight = previous;
+}
+
+BandwidthScheduler &BandwidthScheduler::getInstance() {
+    static BandwidthScheduler instance;
+    return instance;
+}
+
+void BandwidthScheduler::setRate(Direction direction, uint64_t rate) {
+    Bucket &bucket = buckets[static_cast<int>(direction)];
+    {
+        std::lock_guard<std::mutex> guard(bucket.mutex);
+        bucket.rate = rate;
+        bucket.tokens = 0;
+        bucket.refilled = std::chrono::steady_clock::now();
+    }
+    bucket.condition.notify_all();
+}
+
+void BandwidthScheduler::refill(Bucket &bucket) {
+    auto now = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed = now - bucket.refilled;
+    bucket.tokens = std::min(bucket.tokens + elapsed.count() * bucket.rate, bucket.rate * BURST_TIME);
+    bucket.refilled = now;
+}
+
+void BandwidthScheduler::consume(Direction direction, Flow &flow, size_t bytes) {
+    Bucket &bucket = buckets[static_cast<int>(direction)];
+    std::unique_lock<std::mutex> lock(bucket.mutex);
+    if (bucket.rate == 0)
+        return;
+
+    // flows that were idle start from current virtual time, they have nothing to catch up with
+    double start = std::max(bucket.virtualTime, flow.finish);
+    flow.finish = start + bytes / flow.weight;
+
+    auto ticket = std::make_pair(start, bucket.nextTicket++);
+    bucket.queue.insert(ticket);
+
+    auto queued = std::chrono::steady_clock::now();
+    while (bucket.rate != 0) {
+        refill(bucket);
+        bool first = *bucket.queue.begin() == ticket;
+        if (first && bucket.tokens > 0)
+            break;
+
+        if (first) {
+            // wait for the debt to be paid off
+            std::chrono::duration<double> debt(-bucket.tokens / bucket.rate);
+            bucket.condition.wait_for(lock, std::max(debt, std::chrono::duration<double>(0.001)));
+        } else {
+            bucket.condition.wait(lock);
+        }
+    }
+
+    flow.waited += std::chrono::steady_clock::now() - queued;
+    bucket.queue.erase(ticket);
+    bucket.tokens -= bytes;
+    bucket.virtualTime = start;
+
+    // next one in the queue is up
+    bucket.condition.notify_all();
+}
@@ -0,0 +1,117 @@
+/*****************************************************************************
+ *
+ * Copyright (c) 2018-2020, Oleg `Kanedias` Chernovskiy
+ *
+ * This file is part of MARC-FS.
+ *
+ * MARC-FS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MARC-FS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MARC-FS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BANDWIDTH_SCHEDULER_H
+#define BANDWIDTH_SCHEDULER_H
+
+#include <cstdint>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <set>
+
+/**
+ * @brief The BandwidthScheduler class - mount-wide rate limit shared by all transfers.
+ *
+ * Each direction has a token bucket refilled at configured rate. Transfers ask for tokens
+ * before passing each chunk of data and wait in a queue ordered by virtual start time
+ * (start-time fair queueing), so concurrent transfers share the rate according to their weights.
+ * Single transfer gets the whole rate, unused rate is not kept for more than a moment.
+ */
+class BandwidthScheduler
+{
+public:
+    enum class Direction {
+        DOWNLOAD,
+        UPLOAD
+    };
+
+    /**
+     * @brief The Flow struct - fairness state of one transfer
+     */
+    struct Flow {
+        /**
+         * @brief Flow - create flow with weight of current thread, see @ref Priority
+         */
+        Flow();
+
+        double weight;
+        double finish = 0; // virtual time when last requested chunk is done
+
+        /**
+         * @brief waited - total time this flow has spent waiting for its share of the rate.
+         *        Stall detection doesn't count it, throttled transfer is not a stalled one.
+         */
+        std::chrono::steady_clock::duration waited = {};
+    };
+
+    /**
+     * @brief The Priority class - sets weight of transfers started by current thread
+     *        while in scope. Transfer with weight 2 gets twice the share of the one with 1.
+     */
+    class Priority {
+    public:
+        explicit Priority(double weight);
+        ~Priority();
+
+        Priority(const Priority&) = delete;
+        Priority& operator=(const Priority&) = delete;
+    private:
+        double previous;
+    };
+
+    static BandwidthScheduler &getInstance();
+
+    /**
+     * @brief setRate - set total rate limit
+     * @param direction - direction to limit
+     * @param rate - bytes per second, 0 means unlimited
+     */
+    void setRate(Direction direction, uint64_t rate);
+
+    /**
+     * @brief consume - wait until @param bytes may be transferred within the rate limit
+     * @param direction - direction of transfer
+     * @param flow - transfer these bytes belong to
+     */
+    void consume(Direction direction, Flow &flow, size_t bytes);
+
+private:
+    BandwidthScheduler() = default;
+
+    struct Bucket {
+        std::mutex mutex;
+        std::condition_variable condition;
+
+        double rate = 0;    // bytes per second
+        double tokens = 0;  // may go negative when chunk is bigger than what's accumulated
+        std::chrono::steady_clock::time_point refilled;
+
+        double virtualTime = 0; // start tag of last served chunk
+        uint64_t nextTicket = 0;
+        std::set<std::pair<double, uint64_t>> queue; // start tag and ticket of waiting chunks
+    };
+
+    void refill(Bucket &bucket);
+
+    Bucket buckets[2];
+};
+
+#endif // BANDWIDTH_SCHEDULER_H
@@ -0,0 +1,83 @@
+/*****************************************************************************
+ *
+ * Copyright (c) 2018-2020, Oleg `Kanedias` Chernovskiy
+ *
+ * This file is part of MARC-FS.
+ *
+ * MARC-FS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MARC-FS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MARC-FS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+
+#include "concurrency_limiter.h"
+
+/**
+ * @brief DECREASE_COOLDOWN - limit is cut at most once per this period
+ */
+static const auto DECREASE_COOLDOWN = std::chrono::seconds(1);
+
+/**
+ * @brief LATENCY_TOLERANCE - latency above baseline multiplied by this means overload
+ */
+static const double LATENCY_TOLERANCE = 2.0;
+
+ConcurrencyLimiter::ConcurrencyLimiter(size_t minLimit, size_t maxLimit, size_t initialLimit, bool latencySensitive)
+    : minLimit(minLimit),
+      maxLimit(maxLimit),
+      latencySensitive(latencySensitive),
+      limit(initialLimit) {
+}
+
+void ConcurrencyLimiter::acquire(bool wait) {
+    std::unique_lock<std::mutex> lock(limitMutex);
+    if (wait)
+        condition.wait(lock, [this] { return inFlight < static_cast<size_t>(limit); });
+    inFlight++;
+}
+
+void ConcurrencyLimiter::release(std::chrono::steady_clock::duration latency, bool overloaded) {
+    {
+        std::lock_guard<std::mutex> guard(limitMutex);
+        inFlight--;
+
+        auto now = std::chrono::steady_clock::now();
+        double latencyMs = std::chrono::duration<double, std::milli>(latency).count();
+        if (latencySensitive && !overloaded) {
+            smoothedLatency = smoothedLatency == 0 ? latencyMs : smoothedLatency * 0.9 + latencyMs * 0.1;
+            baselineLatency = baselineLatency == 0 ? smoothedLatency : std::min(baselineLatency * 1.01, smoothedLatency);
+            overloaded = smoothedLatency > baselineLatency * LATENCY_TOLERANCE;
+        }
+
+        if (overloaded) {
+            decrease(now);
+        } else {
+            // additive increase: about +1 per limit's worth of successful requests
+            limit = std::min(maxLimit, limit + 1.0 / limit);
+        }
+    }
+    condition.notify_all();
+}
+
+size_t ConcurrencyLimiter::getLimit() {
+    std::lock_guard<std::mutex> guard(limitMutex);
+    return static_cast<size_t>(limit);
+}
+
+void ConcurrencyLimiter::decrease(std::chrono::steady_clock::time_point now) {
+    if (now - lastDecrease < DECREASE_COOLDOWN)
+        return;
+
+    limit = std::max(minLimit, limit / 2);
+    lastDecrease = now;
+}
@@ -0,0 +1,88 @@
+/*****************************************************************************
+ *
+ * Copyright (c) 2018-2020, Oleg `Kanedias` Chernovskiy
+ *
+ * This file is part of MARC-FS.
+ *
+ * MARC-FS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MARC-FS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MARC-FS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CONCURRENCY_LIMITER_H
+#define CONCURRENCY_LIMITER_H
+
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+
+/**
+ * @brief The ConcurrencyLimiter class - limits count of requests in flight, adapting
+ *        the limit to what the service currently accepts (AIMD, as in TCP congestion control).
+ *
+ * Each successful request grows the limit a bit, so it grows by about one per round of requests.
+ * Throttling, server errors and, if enabled, rising latency cut the limit in half.
+ * Latency is compared against the lowest one seen recently, so it only makes sense
+ * for requests of similar cost, e.g. metadata calls, not transfers of different size.
+ */
+class ConcurrencyLimiter
+{
+public:
+    /**
+     * @brief ConcurrencyLimiter - create limiter
+     * @param minLimit - limit never goes lower than this
+     * @param maxLimit - limit never goes higher than this
+     * @param initialLimit - limit to start with
+     * @param latencySensitive - whether rising latency means overload
+     */
+    ConcurrencyLimiter(size_t minLimit, size_t maxLimit, size_t initialLimit, bool latencySensitive);
+
+    /**
+     * @brief acquire - wait until request may be started
+     * @param wait - if false, request is counted right away even above the limit.
+     *        For requests that holders of other slots may wait for, waiting
+     *        for a slot could deadlock them.
+     */
+    void acquire(bool wait = true);
+
+    /**
+     * @brief release - mark request as finished and account its outcome
+     * @param latency - how long request took
+     * @param overloaded - whether service signalled it's overloaded (throttling, server errors)
+     */
+    void release(std::chrono::steady_clock::duration latency, bool overloaded);
+
+    size_t getLimit();
+
+private:
+    /**
+     * @brief decrease - cut the limit, at most once per cooldown,
+     *        as requests of one burst usually fail together
+     */
+    void decrease(std::chrono::steady_clock::time_point now);
+
+    const double minLimit;
+    const double maxLimit;
+    const bool latencySensitive;
+
+    std::mutex limitMutex;
+    std::condition_variable condition;
+
+    double limit;
+    size_t inFlight = 0;
+
+    double smoothedLatency = 0; // ms, moving average
+    double baselineLatency = 0; // ms, lowest smoothed latency, slowly drifting up
+    std::chrono::steady_clock::time_point lastDecrease;
+};
+
+#endif // CONCURRENCY_LIMITER_H
@@ -54,6 +54,8 @@ void FileStorage::open()
 
 bool FileStorage::empty()
 {
+    std::lock_guard<std::mutex> guard(rw_mutex);
+
     if (!data.is_open())
         return true;
 
@@ -66,6 +68,8 @@ bool FileStorage::empty()
 
 size_t FileStorage::size()
 {
+    std::lock_guard<std::mutex> guard(rw_mutex);
+
     if (!data.is_open())
         return 0;
 
@@ -99,12 +103,16 @@ int FileStorage::write(const char *buf, size_t size, uint64_t offset)
 
 void FileStorage::append(const char *buf, size_t size)
 {
+    std::lock_guard<std::mutex> guard(rw_mutex);
+
     data.seekp(0, std::ios::end);
     data.write(buf, static_cast<std::streamoff>(size));
 }
 
 std::string FileStorage::readFully()
 {
+    std::lock_guard<std::mutex> guard(rw_mutex);
+
     data.seekg(0);
     std::stringstream buffer;
     buffer << data.rdbuf();
@@ -113,12 +121,17 @@ std::string FileStorage::readFully()
 
 void FileStorage::clear()
 {
+    std::lock_guard<std::mutex> guard(rw_mutex);
+
     data.close();
     remove(filename.c_str());
 }
 
 void FileStorage::truncate(off_t size)
 {
+    // stream is reopened here, background readers must not see it closed
+    std::lock_guard<std::mutex> guard(rw_mutex);
+
     data.close();
     std::filesystem::resize_file(filename, size);
     data.open(filename, std::ios::out | std::ios::in | std::ios::binary);
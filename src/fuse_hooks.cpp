@@ -18,11 +18,22 @@
  * along with MARC-FS.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <fcntl.h>
+#include <algorithm>
 #include <regex>
+#include <sstream>
+#include <cstring>
 #include <vector>
 #include <unordered_map>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
 
 #include "fuse_hooks.h"
+#include "concurrency_limiter.h"
+#include "bandwidth_scheduler.h"
 
 #include "marc_file_node.h"
 #include "marc_dir_node.h"
@@ -34,30 +45,194 @@
 
 const static std::regex COMPOUND_REGEX("(.+)(\\.marcfs-part-)(\\d+)");
 const static std::regex SHARE_LINK_REGEX("(.+)(\\.marcfs-link)(.*)");
+// files that are written only to be renamed over the target or deleted soon after:
+// GLib's .goutputstream-XXXXXX, rsync's .name.XXXXXX, JetBrains' name___jb_tmp___,
+// generic name.tmp, emacs lock files .#name, vim swap files .name.swp/.name.swx and
+// its 4913 write probe. Ordinary file that happens to match is uploaded after grace period
+const static std::regex TEMP_FILE_REGEX("(.*/)?(\\.goutputstream-.+|\\..+\\.[A-Za-z0-9]{6}|.+___jb_tmp___|"
+                                        ".+\\.tmp|\\.#.+|\\..+\\.sw[px]|4913)");
+
+// read-only extended attributes of regular files
+const static std::string XATTR_HASH = "user.marcfs.hash";
+const static std::string XATTR_SIZE = "user.marcfs.size";
+const static std::string XATTR_PARTS = "user.marcfs.parts";
+
+/**
+ * @brief DEFERRED_UPLOAD_GRACE - how long closed temporary file waits for rename before upload
+ */
+const static auto DEFERRED_UPLOAD_GRACE = 2s;
+
+/**
+ * @brief DEFERRED_RETRY_DELAY - how long deferred file waits before next attempt if upload failed
+ */
+const static auto DEFERRED_RETRY_DELAY = 30s;
+
+/**
+ * @brief DEFERRED_FINAL_ATTEMPTS - how many times deferred file is tried on unmount before it's given up
+ */
+const static int DEFERRED_FINAL_ATTEMPTS = 3;
 
 ObjectPool<MarcRestClient> clientPool;
 std::string cacheDir;
+bool uploadOnRelease = false;
+/**
+ * @brief interactiveClients - clients of the pool that transfers never take,
+ *        so listings and stats stay responsive while big files are copied
+ */
+size_t interactiveClients = 5;
+RetryPolicy retryPolicy;
+/**
+ * @brief mountSetup - login and pool population, performed in background once mounted,
+ *        so mount doesn't wait for it. Cloud calls wait until it's done.
+ */
+std::function<void()> mountSetup;
 
-static int doWithRetry(std::function<int(MarcRestClient *)> what) {
-    uint retries = 3;
-
-    while (retries > 0) {
-        try {
-            auto client = clientPool.acquire();
-            return what(client.get());
-        } catch (MailApiException &exc) {
-            std::cerr << "Error in " << __FUNCTION__ << ": " << exc.what() << std::endl;
-            if (exc.getResponseCode() >= 500) {
-                retries--;
-                continue;
-            }
+static std::mutex readyMutex;
+static std::condition_variable readyCondition;
+static bool ready = false;
+static bool setupFailed = false;
+static std::thread setupWorker;
 
-            return -EIO;
+/**
+ * @brief awaitReady - wait until mount setup is finished
+ * @return true if cloud can be used, false if setup failed
+ */
+static bool awaitReady() {
+    std::unique_lock<std::mutex> lock(readyMutex);
+    readyCondition.wait(lock, [] { return ready; });
+    return !setupFailed;
+}
+
+/**
+ * @brief setupMount - perform @ref mountSetup and open the latch, then warm up connections.
+ *        Filesystem exits if setup fails, there's nothing it can do without login.
+ *        As this runs outside of FUSE loop, exit only happens on the next filesystem request.
+ * @param fs - filesystem to exit
+ */
+static void setupMount(struct fuse *fs) {
+    bool failed = false;
+    try {
+        if (mountSetup)
+            mountSetup();
+    } catch (std::exception &exc) {
+        std::cerr << "Couldn't login to the cloud, exiting: " << exc.what() << std::endl;
+        failed = true;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(readyMutex);
+        ready = true;
+        setupFailed = failed;
+    }
+    readyCondition.notify_all();
+
+    if (failed) {
+        fuse_exit(fs);
+        return;
+    }
+
+    auto client = clientPool.acquire();
+    client->warmUp();
+}
+
+/**
+ * @brief The Workload enum - kind of cloud calls, each has its own concurrency limit
+ */
+enum class Workload {
+    METADATA,   // listings, removals, renames and other short calls
+    TRANSFER    // downloads and uploads of file content
+};
+
+static ConcurrencyLimiter metadataLimiter(1, 25, 8, true);
+static ConcurrencyLimiter transferLimiter(1, 25, 4, false); // latency depends on size here
+
+/**
+ * @brief limiterDepth - nested calls are part of the outer one and don't take
+ *        another slot, otherwise they could wait for themselves forever
+ */
+thread_local static int limiterDepth = 0;
+
+/**
+ * @brief doWithRetry - perform cloud call on pooled client, retrying transient failures
+ * @param what - the call
+ * @param workload - kind of the call, see @ref Workload
+ * @param idempotent - false for calls that can't be repeated if they may have been applied,
+ *        e.g. renames: source is gone after the first one
+ */
+static int doWithRetry(std::function<int(MarcRestClient *)> what, Workload workload = Workload::METADATA, bool idempotent = true) {
+    ConcurrencyLimiter &limiter = workload == Workload::METADATA ? metadataLimiter : transferLimiter;
+    bool limited = limiterDepth == 0;
+    bool reauthenticated = false;
+    if (!awaitReady())
+        return -EIO;
+
+    for (uint attempt = 0; ; ++attempt) {
+        {
+            if (limited)
+                limiter.acquire();
+
+            limiterDepth++;
+            bool overloaded = false;
+            auto started = std::chrono::steady_clock::now();
+            ScopeGuard releaser = [&] {
+                limiterDepth--;
+                if (limited)
+                    limiter.release(std::chrono::steady_clock::now() - started, overloaded);
+            };
+
+            size_t reserve = workload == Workload::TRANSFER ? interactiveClients : 0;
+            auto client = clientPool.acquire(reserve);
+            started = std::chrono::steady_clock::now(); // waiting for a client is not latency of the cloud
+            try {
+                return what(client.get());
+            } catch (CircuitOpenException &exc) {
+                // endpoint is down, fail fast
+                std::cerr << "Error in " << __FUNCTION__ << ": " << exc.what() << std::endl;
+                return -EIO;
+            } catch (MailApiException &exc) {
+                std::cerr << "Error in " << __FUNCTION__ << ": " << exc.what() << std::endl;
+                if (isAuthFailure(exc.getResponseCode()) && !reauthenticated) {
+                    // session has expired, renew it and try again right away
+                    reauthenticated = true;
+                    try {
+                        client->reauthenticate();
+                    } catch (MailApiException &loginExc) {
+                        std::cerr << "Couldn't renew session: " << loginExc.what() << std::endl;
+                        return -EIO;
+                    }
+                    continue;
+                }
+
+                overloaded = isTransient(exc);
+                if (!retryPolicy.shouldRetry(exc, attempt, idempotent))
+                    return -EIO;
+            }
         }
+
+        // client and slot are released, wait before next attempt
+        std::this_thread::sleep_for(retryPolicy.backoff(attempt));
     }
+}
 
-    // should never happen
-    return -EINVAL;
+std::string doTransfer(std::function<std::string(MarcRestClient *)> what) {
+    if (!awaitReady())
+        throw MailApiException("Not logged in to the cloud");
+
+    transferLimiter.acquire(false);
+    bool overloaded = false;
+    auto started = std::chrono::steady_clock::now();
+    ScopeGuard releaser = [&] {
+        transferLimiter.release(std::chrono::steady_clock::now() - started, overloaded);
+    };
+
+    auto client = clientPool.acquire(interactiveClients);
+    started = std::chrono::steady_clock::now();
+    try {
+        return what(client.get());
+    } catch (MailApiException &exc) {
+        overloaded = isTransient(exc);
+        throw;
+    }
 }
 
 /**
@@ -81,6 +256,7 @@ static int doWithRetry(std::function<int(MarcRestClient *)> what) {
  */
 void handleCompounds(std::vector<CloudFile> &files) {
     std::unordered_map<std::string, CloudFile> compounds;
+    std::unordered_map<std::string, std::map<off_t, std::string>> partHashes;
     auto newEnd = remove_if(files.begin(), files.end(), [&](CloudFile &file){
         std::string fileName = file.getName();
 
@@ -88,6 +264,7 @@ void handleCompounds(std::vector<CloudFile> &files) {
         std::smatch match;
         if (regex_match(fileName, match, COMPOUND_REGEX)) {
             std::string origName = match[1];
+            partHashes[origName][std::stoll(match[3])] = file.getHash();
 
             if (compounds.find(origName) == compounds.end()) {
                 auto complex = CloudFile(file);
@@ -104,6 +281,15 @@ void handleCompounds(std::vector<CloudFile> &files) {
     });
     // erase compound parts from original iterator
     files.erase(newEnd, files.end());
+    // hash of compound is hashes of its parts, in order
+    for (auto &entry : compounds) {
+        std::string hash;
+        for (auto &part : partHashes[entry.first]) {
+            hash += (hash.empty() ? "" : ",") + part.second;
+        }
+        entry.second.setHash(hash);
+    }
+
     // populate with collapsed compounds
     for_each(compounds.cbegin(), compounds.cend(), [&](auto it){ files.push_back(it.second); });
 }
@@ -139,11 +325,19 @@ static int handleLinks(std::string filePath, MarcFileNode* file) {
         // it's compound, retrieve links for each part
         off_t partCount = (origFileInfo.st_size / MARCFS_MAX_FILE_SIZE) + 1;
         doWithRetry([&](MarcRestClient *client) {
+            // request links for all parts at once
+            std::vector<std::future<std::string>> shares;
+            for (off_t idx = 0; idx < partCount; ++idx) {
+                shares.push_back(client->shareAsync(origPath + MARCFS_SUFFIX + std::to_string(idx)));
+            }
+
+            std::string partLinks;
             for (off_t idx = 0; idx < partCount; ++idx) {
                 std::string extendedPath = origPath + MARCFS_SUFFIX + std::to_string(idx);
-                link += extendedPath + ": ";
-                link += SCLD_PUBLICLINK_ENDPOINT + '/' + client->share(extendedPath) + '\n';
+                partLinks += extendedPath + ": ";
+                partLinks += SCLD_PUBLICLINK_ENDPOINT + '/' + shares[idx].get() + '\n';
             }
+            link = partLinks;
             return 0;
         });
     } else {
@@ -180,17 +374,306 @@ int chmodCallback(const char */*path*/, mode_t /*mode*/, fuse_file_info */*fi*/)
     return 0;
 }
 
+/**
+ * @brief uploadFile - upload changes of opened file to the cloud, if there are any
+ * @param path - path to the file
+ * @param file - opened file node
+ */
+static int uploadFile(const char *path, MarcFileNode *file) {
+    return doWithRetry([&](MarcRestClient *client) {
+        file->flush(client, path);
+        CacheManager::getInstance()->update(path, *file);
+        CacheManager::getInstance()->unpin(path); // it's in the cloud now
+        return 0;
+    }, Workload::TRANSFER);
+}
+
+static std::mutex openFilesMutex;
+/**
+ * @brief openFiles - nodes of files that are opened now, by path they were opened with.
+ *        Changes in these nodes may be not uploaded yet.
+ */
+static std::multimap<std::string, MarcFileNode *> openFiles;
+
+/**
+ * @brief trackOpen - remember opened file node
+ * @param path - path to the file
+ * @param file - opened file node
+ */
+static void trackOpen(const std::string &path, MarcFileNode *file) {
+    std::lock_guard<std::mutex> guard(openFilesMutex);
+    openFiles.emplace(path, file);
+}
+
+/**
+ * @brief untrackOpen - forget file node that is about to be released
+ * @param path - path to the file
+ * @param file - opened file node
+ */
+static void untrackOpen(const std::string &path, MarcFileNode *file) {
+    std::lock_guard<std::mutex> guard(openFilesMutex);
+    auto range = openFiles.equal_range(path);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (it->second == file) {
+            openFiles.erase(it);
+            return;
+        }
+    }
+}
+
+/**
+ * @brief renameOpen - follow rename with file nodes opened under old path or inside it
+ * @param oldPath - path to the renamed file or directory
+ * @param newPath - target path of rename
+ * @param exchange - whether paths were exchanged, nodes under target move to old path then
+ */
+static void renameOpen(const std::string &oldPath, const std::string &newPath, bool exchange) {
+    auto movedPath = [](const std::string &path, const std::string &from, const std::string &to) {
+        if (path == from)
+            return to;
+        if (path.find(from + '/') == 0)
+            return to + path.substr(from.size());
+        return std::string();
+    };
+
+    std::lock_guard<std::mutex> guard(openFilesMutex);
+    std::multimap<std::string, MarcFileNode *> renamed;
+    for (auto &entry : openFiles) {
+        std::string path = movedPath(entry.first, oldPath, newPath);
+        if (path.empty() && exchange)
+            path = movedPath(entry.first, newPath, oldPath);
+        renamed.emplace(path.empty() ? entry.first : path, entry.second);
+    }
+    openFiles.swap(renamed);
+}
+
+/**
+ * @brief The DeferredUpload struct - new temporary file that is closed but not uploaded yet.
+ *
+ * Editors and many other tools save files by writing a temporary file and renaming
+ * it over the original. Upload of such file is postponed for a short grace period,
+ * so rename can upload it straight to the final path instead.
+ */
+struct DeferredUpload {
+    std::unique_ptr<MarcFileNode> file;
+    std::chrono::steady_clock::time_point deadline;
+};
+
+static std::mutex deferredMutex;
+static std::condition_variable deferredCondition;
+static std::map<std::string, DeferredUpload> deferredUploads;
+static std::thread deferredWorker;
+static bool deferredStop = false;
+
+/**
+ * @brief isDeferrable - check whether upload of the file may wait for a rename
+ * @param path - path to the file
+ * @param file - opened file node
+ */
+static bool isDeferrable(const std::string &path, MarcFileNode *file) {
+    return file->isNew() && file->isDirty() && regex_match(path, TEMP_FILE_REGEX);
+}
+
+/**
+ * @brief deferUpload - postpone upload of closed file, take ownership of its node
+ * @param path - path to the file
+ * @param file - opened file node, still holding its content
+ */
+static void deferUpload(const std::string &path, std::unique_ptr<MarcFileNode> file) {
+    std::lock_guard<std::mutex> guard(deferredMutex);
+    auto deadline = std::chrono::steady_clock::now() + DEFERRED_UPLOAD_GRACE;
+    deferredUploads[path] = DeferredUpload{std::move(file), deadline};
+}
+
+/**
+ * @brief takeDeferred - take node of deferred file back from the queue
+ * @param path - path to the file
+ * @return file node or nullptr if upload of this path is not deferred
+ */
+static std::unique_ptr<MarcFileNode> takeDeferred(const std::string &path) {
+    std::lock_guard<std::mutex> guard(deferredMutex);
+    auto it = deferredUploads.find(path);
+    if (it == deferredUploads.end())
+        return nullptr;
+
+    auto file = std::move(it->second.file);
+    deferredUploads.erase(it);
+    return file;
+}
+
+/**
+ * @brief uploadDeferred - upload file taken from deferred queue. If upload fails, file is put
+ *        back to try again later, its content is the only copy: close() has already succeeded
+ * @param path - path to the file
+ * @param file - file node taken from the queue
+ * @return result of upload
+ */
+static int uploadDeferred(const std::string &path, std::unique_ptr<MarcFileNode> file) {
+    int res = uploadFile(path.data(), file.get());
+    if (res == 0) {
+        file->release();
+        return 0;
+    }
+
+    std::unique_lock<std::mutex> lock(deferredMutex);
+    if (deferredUploads.find(path) != deferredUploads.end()) {
+        // replaced by a newer file meanwhile, this content is obsolete
+    } else {
+        auto deadline = std::chrono::steady_clock::now() + DEFERRED_RETRY_DELAY;
+        deferredUploads[path] = DeferredUpload{std::move(file), deadline};
+        return res;
+    }
+
+    lock.unlock();
+    file->release();
+    return res;
+}
+
+/**
+ * @brief settleDeferred - upload deferred files under this path right now,
+ *        used before operations that need the file to be in the cloud
+ * @param path - path to the file or directory
+ */
+static int settleDeferred(const std::string &path) {
+    std::vector<std::string> paths;
+    {
+        std::lock_guard<std::mutex> guard(deferredMutex);
+        for (auto &entry : deferredUploads) {
+            if (entry.first == path || entry.first.find(path + '/') == 0)
+                paths.push_back(entry.first);
+        }
+    }
+
+    int res = 0;
+    for (auto &filePath : paths) {
+        auto file = takeDeferred(filePath);
+        if (!file)
+            continue; // taken by someone else
+
+        int fileRes = uploadDeferred(filePath, std::move(file));
+        if (fileRes)
+            res = fileRes;
+    }
+    return res;
+}
+
+/**
+ * @brief hasUnsavedChanges - check whether any opened or closed but not yet uploaded node
+ *        of the file has changes the cloud doesn't have
+ * @param path - path to the file
+ */
+static bool hasUnsavedChanges(const std::string &path) {
+    {
+        std::lock_guard<std::mutex> guard(deferredMutex);
+        if (deferredUploads.find(path) != deferredUploads.end())
+            return true;
+    }
+
+    std::lock_guard<std::mutex> guard(openFilesMutex);
+    auto range = openFiles.equal_range(path);
+    return std::any_of(range.first, range.second, [](auto &entry) { return entry.second->isDirty(); });
+}
+
+/**
+ * @brief deferredUploadLoop - upload deferred files nobody renamed within grace period.
+ *        Whatever is left once stopped is uploaded by @ref flushDeferred
+ */
+static void deferredUploadLoop() {
+    BandwidthScheduler::Priority background(0.5); // nobody waits for these, yield to others
+    std::unique_lock<std::mutex> lock(deferredMutex);
+    while (!deferredStop) {
+        deferredCondition.wait_for(lock, 1s);
+
+        auto now = std::chrono::steady_clock::now();
+        auto it = deferredUploads.begin();
+        while (!deferredStop && it != deferredUploads.end()) {
+            if (it->second.deadline > now) {
+                ++it;
+                continue;
+            }
+
+            std::string path = it->first;
+            auto file = std::move(it->second.file);
+            deferredUploads.erase(it);
+
+            lock.unlock();
+            uploadDeferred(path, std::move(file));
+            lock.lock();
+
+            // queue may have changed meanwhile
+            it = deferredUploads.begin();
+        }
+    }
+}
+
+/**
+ * @brief flushDeferred - upload all deferred files on unmount, regardless of grace period.
+ *        Each file gets several attempts, files that still fail are reported one by one,
+ *        their content can't be kept anywhere after this.
+ * @return count of files that couldn't be uploaded
+ */
+static size_t flushDeferred() {
+    std::map<std::string, DeferredUpload> remaining;
+    {
+        std::lock_guard<std::mutex> guard(deferredMutex);
+        remaining.swap(deferredUploads);
+    }
+
+    size_t lost = 0;
+    for (auto &entry : remaining) {
+        auto file = entry.second.file.get();
+
+        int res = -EIO;
+        for (int attempt = 0; attempt < DEFERRED_FINAL_ATTEMPTS && res; ++attempt) {
+            if (attempt > 0)
+                std::this_thread::sleep_for(retryPolicy.backoff(static_cast<uint>(attempt)));
+
+            res = uploadFile(entry.first.data(), file);
+        }
+        if (res) {
+            std::cerr << "ERROR: couldn't upload " << entry.first << " before unmount (" << strerror(-res)
+                      << "), " << file->getSize() << " bytes of its content are lost" << std::endl;
+            ++lost;
+        }
+        file->release();
+    }
+    return lost;
+}
+
 void * initCallback(fuse_conn_info *conn, fuse_config *cfg) {
     conn->want |= FUSE_CAP_ASYNC_READ;
     conn->want |= FUSE_CAP_DONT_MASK;
+    conn->want |= FUSE_CAP_ATOMIC_O_TRUNC; // pass O_TRUNC to open, we can skip download then
 
     cfg->direct_io = 1;
     cfg->entry_timeout = 60;
     cfg->attr_timeout = 60;
     cfg->negative_timeout = 60;
+
+    deferredWorker = std::thread(deferredUploadLoop);
+    setupWorker = std::thread(setupMount, fuse_get_context()->fuse);
     return nullptr;
 }
 
+void destroyCallback(void */*private_data*/) {
+    {
+        std::lock_guard<std::mutex> guard(deferredMutex);
+        deferredStop = true;
+    }
+    deferredCondition.notify_all();
+
+    if (deferredWorker.joinable())
+        deferredWorker.join();
+
+    // upload whatever is still waiting for rename, synchronously
+    size_t lost = flushDeferred();
+    if (lost)
+        std::cerr << "ERROR: " << lost << " file(s) were not uploaded to the cloud" << std::endl;
+
+    if (setupWorker.joinable())
+        setupWorker.join();
+}
+
 int getattrCallback(const char *path, struct stat *stbuf, fuse_file_info *fi) {
     // retrieve path to containing dir
     std::string pathStr(path);  // e.g. /home/1517.svg
@@ -241,7 +724,7 @@ int getattrCallback(const char *path, struct stat *stbuf, fuse_file_info *fi) {
             // put all retrieved files in cache
             struct stat temp = {};
             fillStat(&temp, &cf);
-            statCache->put(fullPath, CacheNode(temp));
+            statCache->put(fullPath, CacheNode(temp, cf.getHash()));
 
             if (cf.getName() == filename) {
                 // file found
@@ -283,18 +766,74 @@ int statfsCallback(const char */*path*/, struct statvfs *stat) {
 
 }
 
-int openCallback(const char *path, struct fuse_file_info *fi) {
-    auto statCache = CacheManager::getInstance();
+/**
+ * @brief fetchContent - download content of lazily opened file if it's not there yet
+ * @param path - path to the file
+ * @param file - opened file node
+ */
+static int fetchContent(const char *path, MarcFileNode *file) {
+    if (!file->needsDownload())
+        return 0;
 
     return doWithRetry([&](MarcRestClient *client) {
-        auto cached = statCache->get(path);
-        auto file = new MarcFileNode(cached->stbuf);
-        file->open(client, path);
-
-        // no errors
-        fi->fh = reinterpret_cast<uintptr_t>(file);
+        file->fetch(client, path);
         return 0;
-    });
+    }, Workload::TRANSFER);
+}
+
+/**
+ * @brief cachedHash - content hash of the file from stat cache, empty if it's not known
+ */
+static std::string cachedHash(const char *path) {
+    auto cached = CacheManager::getInstance()->get(path);
+    return cached ? cached->hash : std::string();
+}
+
+int openCallback(const char *path, struct fuse_file_info *fi) {
+    int res = settleDeferred(path);
+    if (res)
+        return res;
+
+    struct stat stbuf = {};
+    res = getattrCallback(path, &stbuf, nullptr);
+    if (res)
+        return res;
+
+    // content is downloaded only when read or partial overwrite requires it: it may be
+    // discarded by O_TRUNC, copied server-side or not needed at all. Same node is kept
+    // between attempts, so failed download is resumed on next read, not restarted
+    auto file = new MarcFileNode(stbuf);
+    file->setRemoteHash(cachedHash(path));
+    file->openLazy();
+    if (fi->flags & O_TRUNC)
+        file->truncate(0);
+
+    trackOpen(path, file);
+    fi->fh = reinterpret_cast<uintptr_t>(file);
+    return 0;
+}
+
+int createCallback(const char *path, mode_t /*mode*/, fuse_file_info *fi) {
+    // no need to create the file in the cloud right now, first flush will upload it
+    struct stat stbuf = {};
+    emptyStat(&stbuf, S_IFREG);
+
+    auto file = new MarcFileNode(stbuf);
+    file->openNew();
+
+    // cloud doesn't know about this file until it's flushed, don't let the entry expire
+    CacheNode node(stbuf);
+    node.pinned = true;
+    CacheManager::getInstance()->put(path, node);
+
+    // new file replaces the one that was waiting for rename, if any
+    auto replaced = takeDeferred(path);
+    if (replaced)
+        replaced->release();
+
+    trackOpen(path, file);
+    fi->fh = reinterpret_cast<uintptr_t>(file);
+    return 0;
 }
 
 int opendirCallback(const char *path, fuse_file_info *fi) {
@@ -319,7 +858,7 @@ int readdirCallback(const char *path, void *dirhandle, fuse_fill_dir_t filler, o
 
             struct stat stbuf = {};
             fillStat(&stbuf, &cf);
-            statCache->put(fullPath, CacheNode(stbuf));
+            statCache->put(fullPath, CacheNode(stbuf, cf.getHash()));
 
             filler(dirhandle, cf.getName().data(), &stbuf, 0, (fuse_fill_dir_flags) 0);
         }
@@ -337,12 +876,20 @@ int releasedirCallback(const char *path, fuse_file_info *fi) {
 
 int readCallback(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
     auto file = reinterpret_cast<MarcFileNode *>(fi->fh);
+    int res = fetchContent(path, file);
+    if (res)
+        return res;
+
     auto offsetBytes = static_cast<uint64_t>(offset);
     return file->read(buf, size, offsetBytes);
 }
 
 int writeCallback(const char *path, const char *buf, size_t size, off_t offset, fuse_file_info *fi) {
     auto file = reinterpret_cast<MarcFileNode *>(fi->fh);
+    int res = fetchContent(path, file); // partial overwrite needs old content
+    if (res)
+        return res;
+
     auto offsetBytes = static_cast<uint64_t>(offset);
     return file->write(buf, size, offsetBytes);
 }
@@ -356,19 +903,57 @@ int flushCallback(const char *path, struct fuse_file_info *fi) {
     if (res)
         return res;
 
-    return doWithRetry([&](MarcRestClient *client) {
-        file->flush(client, path);
+    if (uploadOnRelease || isDeferrable(path, file)) {
+        // this may be just one of many duplicated descriptors, or a temporary file
+        // that is about to be renamed, upload is postponed until release or fsync
         CacheManager::getInstance()->update(path, *file);
         return 0;
-    });
+    }
+
+    return uploadFile(path, file);
+}
+
+int fsyncCallback(const char *path, int /*datasync*/, struct fuse_file_info *fi) {
+    // content closed earlier under the same path must not end up older than this one
+    int res = settleDeferred(path);
+    if (res)
+        return res;
+
+    auto file = reinterpret_cast<MarcFileNode *>(fi->fh);
+    return uploadFile(path, file);
+}
+
+int fsyncdirCallback(const char *path, int /*datasync*/, struct fuse_file_info */*fi*/) {
+    // atomic save ends with fsync of the directory, after that new files must be durable
+    return settleDeferred(path);
 }
 
 int releaseCallback(const char *path, struct fuse_file_info *fi) {
     auto file = reinterpret_cast<MarcFileNode *>(fi->fh);
+    untrackOpen(path, file);
+
+    if (isDeferrable(path, file)) {
+        // likely a temporary file of atomic save, wait for rename before uploading
+        deferUpload(path, std::unique_ptr<MarcFileNode>(file));
+        return 0;
+    }
+
+    int res = 0;
+    if (uploadOnRelease) {
+        // last descriptor is closed, upload now
+        // FUSE ignores this result, errors only reach the log
+        res = uploadFile(path, file);
+    }
+
+    if (file->isNew()) {
+        // never made it to the cloud, nothing keeps its entry alive anymore
+        CacheManager::getInstance()->unpin(path);
+    }
+
     file->release();
     delete file;
 
-    return 0;
+    return res;
 }
 
 int mkdirCallback(const char *path, mode_t /*mode*/) {
@@ -394,6 +979,14 @@ int rmdirCallback(const char *path) {
  * Unlink is only for files, directories get @ref rmdir instead
  */
 int unlinkCallback(const char *path) {
+    auto deferred = takeDeferred(path);
+    if (deferred) {
+        // never reached the cloud, nothing to remove there
+        deferred->release();
+        CacheManager::getInstance()->remove(path);
+        return 0;
+    }
+
     // should we check for the file first?
     struct stat stbuf = {};
     int res = getattrCallback(path, &stbuf, nullptr);
@@ -416,14 +1009,71 @@ int unlinkCallback(const char *path) {
     });
 }
 
+/**
+ * @brief renameDeferred - upload deferred file straight to the path it's renamed to
+ * @param oldPath - path the file was written to
+ * @param newPath - target path of rename
+ * @param flags - rename flags
+ * @param file - deferred file node
+ */
+static int renameDeferred(const char *oldPath, const char *newPath, unsigned int flags, std::unique_ptr<MarcFileNode> file) {
+    struct stat newStat = {};
+    int targetErr = getattrCallback(newPath, &newStat, nullptr);
+    if (targetErr == 0 && flags & RENAME_NOREPLACE) {
+        // file exists and replacement is not allowed, keep waiting under old name
+        deferUpload(oldPath, std::move(file));
+        return -EEXIST;
+    }
+
+    // new content is uploaded over the old target first,
+    // then flush removes old parts it didn't overwrite
+    if (targetErr == 0)
+        file->setRemote(true, newStat.st_size);
+
+    int res = doWithRetry([&](MarcRestClient *client) {
+        file->flush(client, newPath);
+        return 0;
+    }, Workload::TRANSFER);
+
+    if (res) {
+        // keep the content, it'll be uploaded under the old name
+        file->setRemote(false, 0);
+        deferUpload(oldPath, std::move(file));
+        return res;
+    }
+
+    CacheManager::getInstance()->remove(oldPath);
+    CacheManager::getInstance()->update(newPath, *file);
+    file->release();
+    return 0;
+}
+
 int renameCallback(const char *oldPath, const char *newPath, unsigned int flags) {
+    auto deferred = takeDeferred(oldPath);
+    if (deferred && !(flags & RENAME_EXCHANGE))
+        return renameDeferred(oldPath, newPath, flags, std::move(deferred));
+
+    if (deferred) {
+        // exchange needs both files in the cloud
+        int res = uploadDeferred(oldPath, std::move(deferred));
+        if (res)
+            return res;
+    }
+
+    // both source and target must be in the cloud to be moved
+    int res = settleDeferred(oldPath);
+    if (!res)
+        res = settleDeferred(newPath);
+    if (res)
+        return res;
+
     struct stat oldStat = {};
     int srcErr = getattrCallback(oldPath, &oldStat, nullptr);
     if (srcErr)
         return srcErr;
     
     MarcFileNode sourceFile(oldStat);
-    return doWithRetry([&](MarcRestClient *client) {
+    res = doWithRetry([&](MarcRestClient *client) {
         // get info about the target
         struct stat newStat = {};
         int targetErr = getattrCallback(newPath, &newStat, nullptr);
@@ -455,30 +1105,196 @@ int renameCallback(const char *oldPath, const char *newPath, unsigned int flags)
         // it will fail here with -EIO as actual addition happens only after file is uploaded
         sourceFile.rename(client, oldPath, newPath);
         return 0;
-    });
+    }, Workload::METADATA, false);
+    if (res)
+        return res;
+
+    renameOpen(oldPath, newPath, flags & RENAME_EXCHANGE);
+    return 0;
 }
 
 int truncateCallback(const char *path, off_t size, fuse_file_info *fi) {
     if (fi && fi->fh) {
         // file is opened, truncate it
         auto file = reinterpret_cast<MarcFileNode *>(fi->fh);
+        if (size > 0) {
+            // truncating to zero discards old content anyway
+            int res = fetchContent(path, file);
+            if (res)
+                return res;
+        }
+
         file->truncate(size);
         CacheManager::getInstance()->update(path, *file);
         return 0;
     }
 
-    // file is not open, just reupload it with requested size
+    int res = settleDeferred(path);
+    if (res)
+        return res;
+
+    struct stat stbuf = {};
+    res = getattrCallback(path, &stbuf, nullptr);
+    if (res)
+        return res;
+
+    // file is not open, truncate it right in the cloud
     return doWithRetry([&](MarcRestClient *client) {
-        // imitate reupload
-        MarcFileNode tempFile;
-        tempFile.open(client, path);
-        tempFile.truncate(size);
-        tempFile.flush(client, path);
-        tempFile.release();
+        MarcFileNode tempFile(stbuf); // need old size to know the layout of the file
+        tempFile.truncate(client, path, size);
         CacheManager::getInstance()->update(path, tempFile);
         return 0;
+    }, Workload::TRANSFER);
+
+}
+
+/**
+ * @brief contentHash - retrieve content hash of a file from stat cache,
+ *        refreshing it from the cloud if it's unknown
+ * @param path - path to the file
+ * @param hash - content hash, part hashes joined with ',' for compound files
+ */
+static int contentHash(const char *path, std::string &hash) {
+    // cloud would report hash of the previous content
+    if (hasUnsavedChanges(path))
+        return -EAGAIN;
+
+    struct stat stbuf = {};
+    int res = getattrCallback(path, &stbuf, nullptr);
+    if (res)
+        return res;
+
+    auto statCache = CacheManager::getInstance();
+    auto cached = statCache->get(path);
+    if (cached && !cached->hash.empty()) {
+        hash = cached->hash;
+        return 0;
+    }
+
+    // local changes invalidated the hash, list containing dir again
+    std::string pathStr(path);
+    auto slashPos = pathStr.find_last_of('/');
+    std::string dirname = pathStr.substr(0, slashPos);
+    std::string filename = pathStr.substr(slashPos + 1);
+
+    res = doWithRetry([&](MarcRestClient *client) {
+        auto contents = client->ls(dirname + "/");
+        handleCompounds(contents);
+
+        for (const CloudFile &cf : contents) {
+            // nothing is pending upload, cloud has the actual content unless it's changed meanwhile
+            if (cf.getName() == filename && static_cast<off_t>(cf.getSize()) == stbuf.st_size) {
+                hash = cf.getHash();
+                break;
+            }
+        }
+        return 0;
     });
+    if (res)
+        return res;
+
+    if (hash.empty())
+        return -ENODATA;
+
+    statCache->setHash(path, hash);
+    return 0;
+}
+
+ssize_t copyFileRangeCallback(const char *pathIn, fuse_file_info *fiIn, off_t offsetIn,
+                              const char *pathOut, fuse_file_info *fiOut, off_t offsetOut,
+                              size_t size, int /*flags*/) {
+    auto source = reinterpret_cast<MarcFileNode *>(fiIn->fh);
+    auto target = reinterpret_cast<MarcFileNode *>(fiOut->fh);
+
+    off_t sourceSize = source->getSize();
+    if (offsetIn >= sourceSize)
+        return 0; // nothing more to copy
+
+    // only whole file can be copied by hash, and only if cloud has the same content as source
+    bool wholeFile = offsetIn == 0 && offsetOut == 0 && static_cast<off_t>(size) >= sourceSize;
+    if (!wholeFile || source->isDirty() || source->isNew() || target->getSize() != 0)
+        return -EOPNOTSUPP; // let the kernel copy it via read/write
+
+    std::string hash;
+    if (contentHash(pathIn, hash))
+        return -EOPNOTSUPP;
+
+    std::vector<std::string> hashes;
+    std::istringstream hashStream(hash);
+    for (std::string part; std::getline(hashStream, part, ',');) {
+        hashes.push_back(part);
+    }
+
+    int res = doWithRetry([&](MarcRestClient *client) {
+        target->cloneFrom(client, pathOut, hashes, sourceSize);
+        CacheManager::getInstance()->update(pathOut, *target);
+        return 0;
+    });
+    if (res)
+        return res;
+
+    return sourceSize;
+}
+
+int getxattrCallback(const char *path, const char *name, char *value, size_t size) {
+    std::string attrName(name);
+    if (attrName != XATTR_HASH && attrName != XATTR_SIZE && attrName != XATTR_PARTS)
+        return -ENODATA;
+
+    struct stat stbuf = {};
+    int res = getattrCallback(path, &stbuf, nullptr);
+    if (res)
+        return res;
+
+    if (!S_ISREG(stbuf.st_mode))
+        return -ENODATA; // only regular files have content
+
+    std::string attrValue;
+    if (attrName == XATTR_HASH) {
+        res = contentHash(path, attrValue);
+        if (res)
+            return res;
+    } else if (attrName == XATTR_SIZE) {
+        attrValue = std::to_string(stbuf.st_size);
+    } else {
+        off_t partCount = stbuf.st_size > MARCFS_MAX_FILE_SIZE ? (stbuf.st_size / MARCFS_MAX_FILE_SIZE) + 1 : 1;
+        attrValue = std::to_string(partCount);
+    }
+
+    if (size == 0)
+        return static_cast<int>(attrValue.size()); // caller asks for required size
+
+    if (size < attrValue.size())
+        return -ERANGE;
+
+    memcpy(value, attrValue.data(), attrValue.size());
+    return static_cast<int>(attrValue.size());
+}
+
+int listxattrCallback(const char *path, char *list, size_t size) {
+    struct stat stbuf = {};
+    int res = getattrCallback(path, &stbuf, nullptr);
+    if (res)
+        return res;
+
+    if (!S_ISREG(stbuf.st_mode))
+        return 0;
+
+    // names are zero-terminated and follow each other
+    std::string names;
+    for (const auto &attrName : {XATTR_HASH, XATTR_SIZE, XATTR_PARTS}) {
+        names += attrName;
+        names += '\0';
+    }
+
+    if (size == 0)
+        return static_cast<int>(names.size());
+
+    if (size < names.size())
+        return -ERANGE;
 
+    memcpy(list, names.data(), names.size());
+    return static_cast<int>(names.size());
 }
 
 int mknodCallback(const char *path, mode_t /*mode*/, dev_t /*dev*/) {
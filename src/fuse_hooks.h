@@ -22,11 +22,28 @@
 #define FUSE_HOOKS_H
 
 #include "mru_cache.h"
+#include "retry_policy.h"
 
 extern ObjectPool<MarcRestClient> clientPool;
 extern std::string cacheDir;
+extern bool uploadOnRelease;
+extern size_t interactiveClients;
+extern RetryPolicy retryPolicy;
+extern std::function<void()> mountSetup;
+
+/**
+ * @brief doTransfer - perform transfer that runs outside of FUSE callbacks, e.g. background upload
+ *        of file parts. Waits for login and counts in transfer concurrency limit, but doesn't
+ *        wait for a free slot, callbacks holding slots may be waiting for this transfer.
+ *        Not retried, callers upload whatever is missing themselves.
+ * @param what - the transfer, performed on pooled client
+ * @return result of the transfer
+ * @throws MailApiException if login failed or transfer failed
+ */
+std::string doTransfer(std::function<std::string(MarcRestClient *)> what);
 
 void * initCallback(struct fuse_conn_info *conn, struct fuse_config *cfg);
+void destroyCallback(void *private_data);
 
 int getattrCallback(const char *patb, struct stat *stbuf, struct fuse_file_info *fi);
 int chmodCallback (const char *path, mode_t mode, struct fuse_file_info *fi);
@@ -35,25 +52,49 @@ int statfsCallback(const char *path, struct statvfs *stat);
  * @note API doesn't support milliseconds, we only have seconds of mtime
  */
 int utimensCallback(const char *path, const struct timespec time[2], struct fuse_file_info *fi);
+/**
+ * @note xattrs are read-only: user.marcfs.hash, user.marcfs.size and user.marcfs.parts
+ */
+int getxattrCallback(const char *path, const char *name, char *value, size_t size);
+int listxattrCallback(const char *path, char *list, size_t size);
 
 
 /**
  * @note mknodCallback - invoked when file is absent when writing
  */
 int mknodCallback(const char *path, mode_t mode, dev_t dev);
+/**
+ * @note createCallback - invoked on open with O_CREAT, new file is kept locally until flushed
+ */
+int createCallback(const char *path, mode_t mode, struct fuse_file_info *fi);
 
 // directory-related
 int opendirCallback(const char *path, struct fuse_file_info *fi);
 int readdirCallback(const char *path, void *dirhandle, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags);
 int releasedirCallback(const char *path, struct fuse_file_info *fi);
+/**
+ * @note fsyncdirCallback - uploads files under this directory that still wait for rename
+ */
+int fsyncdirCallback(const char *path, int datasync, struct fuse_file_info *fi);
 
 // file-related
 int openCallback(const char *path, struct fuse_file_info *fi);
 int readCallback(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
 int writeCallback(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+/**
+ * @note flushCallback - invoked on every close() of every file descriptor, uploads
+ *       changes unless @ref uploadOnRelease is set
+ */
 int flushCallback(const char *path, fuse_file_info *fi);
+int fsyncCallback(const char *path, int datasync, struct fuse_file_info *fi);
 int releaseCallback(const char *path, struct fuse_file_info *fi);
 int truncateCallback(const char *path, off_t size, struct fuse_file_info *fi);
+/**
+ * @note copyFileRangeCallback - whole-file copies are made server-side, by content hash
+ */
+ssize_t copyFileRangeCallback(const char *pathIn, struct fuse_file_info *fiIn, off_t offsetIn,
+                              const char *pathOut, struct fuse_file_info *fiOut, off_t offsetOut,
+                              size_t size, int flags);
 
 int mkdirCallback(const char *path, mode_t mode);
 int rmdirCallback(const char *path);
@@ -25,12 +25,14 @@
 #include <signal.h>     // disabling signal handlers
 #include <filesystem>   // filesystem access
 #include <pwd.h>
+#include <algorithm>    // std::replace
 
 #include <json/json.h>
 
 #include "fuse_hooks.h"
 #include "account.h"
 #include "utils.h"
+#include "bandwidth_scheduler.h"
 
 #define MARC_FS_OPT(t, p, v) { t, offsetof(MarcfsConfig, p), v }
 #define MARC_FS_VERSION "0.1"
@@ -45,9 +47,18 @@ struct MarcfsConfig {
      char *cachedir = nullptr; // cache directory on local filesystem
      char *conffile = nullptr; // config file, default is ~/.config/marcfs/config.json
      char *proxyurl = nullptr; // proxy url, default is taken from http(s)_proxy env var
+     char *sessionfile = nullptr; // saved session, default is ~/.cache/marcfs/session-<username>.json
 
-     long maxDownloadRate = 0; // rate limit on download, in KiB/s
-     long maxUploadRate = 0; // rate limit on upload, in KiB/s
+     long maxDownloadRate = 0; // total rate limit on download, in KiB/s
+     long maxUploadRate = 0; // total rate limit on upload, in KiB/s
+
+     int uploadOnRelease = 0; // upload changes on last close/fsync instead of every close
+
+     long maxRetries = -1; // retries of failed transient cloud calls, default if negative
+     long retryDelay = -1; // base delay before retry, in milliseconds, default if negative
+
+     long lowSpeedLimit = -1; // transfers slower than this are stalled, in bytes/s, default if negative
+     long lowSpeedTime = -1; // for how long transfer may be slow, in seconds, default if negative
 };
 
 // non-value options
@@ -62,8 +73,14 @@ static struct fuse_opt marcfsOpts[] = {
      MARC_FS_OPT("cachedir=%s",   cachedir, 0),
      MARC_FS_OPT("conffile=%s",   conffile, 0),
      MARC_FS_OPT("proxyurl=%s",   proxyurl, 0),
+     MARC_FS_OPT("sessionfile=%s",   sessionfile, 0),
      MARC_FS_OPT("max-download-rate=%l",   maxDownloadRate, 0),
      MARC_FS_OPT("max-upload-rate=%l",   maxUploadRate, 0),
+     MARC_FS_OPT("upload-on-release",   uploadOnRelease, 1),
+     MARC_FS_OPT("max-retries=%l",   maxRetries, 0),
+     MARC_FS_OPT("retry-delay=%l",   retryDelay, 0),
+     MARC_FS_OPT("low-speed-limit=%l",   lowSpeedLimit, 0),
+     MARC_FS_OPT("low-speed-time=%l",   lowSpeedTime, 0),
 
      FUSE_OPT_KEY("-V",         KEY_VERSION),
      FUSE_OPT_KEY("--version",  KEY_VERSION),
@@ -91,8 +108,15 @@ static int marcfs_opt_proc(void */*data*/, const char */*arg*/, int key, struct
             "    -o cachedir=STRING - cache dir for not storing everything in RAM\n"
             "    -o conffile=STRING - json config file location with other params\n"
             "    -o proxyurl=STRING - proxy URL to use for making HTTP calls\n"
-            "    -o max-download-rate=INTEGER - rate limit on download, in KiB/s\n"
-            "    -o max-upload-rate=INTEGER - rate limit on upload, in KiB/s\n"
+            "    -o sessionfile=STRING - file to keep login session in between mounts, empty disables,\n"
+            "                             default is ~/.cache/marcfs/session-USERNAME.json\n"
+            "    -o max-download-rate=INTEGER - total rate limit on download, in KiB/s\n"
+            "    -o max-upload-rate=INTEGER - total rate limit on upload, in KiB/s\n"
+            "    -o upload-on-release - upload changes on last close or fsync only\n"
+            "    -o max-retries=INTEGER - retries of failed cloud calls, default is 3\n"
+            "    -o retry-delay=INTEGER - base delay before retry, in ms, doubles each time, default is 200\n"
+            "    -o low-speed-limit=INTEGER - restart transfers slower than this, in bytes/s, default is 1024, 0 disables\n"
+            "    -o low-speed-time=INTEGER - for how long transfer may be slower, in seconds, default is 30\n"
             , outargs->argv[0]);
             exit(1);
         case KEY_VERSION:
@@ -141,11 +165,29 @@ static void loadConfigFile(MarcfsConfig *conf)
     if (!conf->proxyurl && config["proxyurl"] != Json::Value())
         conf->proxyurl = strdup(config["proxyurl"].asCString());
 
+    if (!conf->sessionfile && config["sessionfile"] != Json::Value())
+        conf->sessionfile = strdup(config["sessionfile"].asCString());
+
     if (!conf->maxDownloadRate && config["max-download-rate"] != Json::Value())
         conf->maxDownloadRate = config["max-download-rate"].asInt64();
 
     if (!conf->maxUploadRate && config["max-upload-rate"] != Json::Value())
         conf->maxUploadRate = config["max-upload-rate"].asInt64();
+
+    if (!conf->uploadOnRelease && config["upload-on-release"] != Json::Value())
+        conf->uploadOnRelease = config["upload-on-release"].asBool();
+
+    if (conf->maxRetries < 0 && config["max-retries"] != Json::Value())
+        conf->maxRetries = config["max-retries"].asInt64();
+
+    if (conf->retryDelay < 0 && config["retry-delay"] != Json::Value())
+        conf->retryDelay = config["retry-delay"].asInt64();
+
+    if (conf->lowSpeedLimit < 0 && config["low-speed-limit"] != Json::Value())
+        conf->lowSpeedLimit = config["low-speed-limit"].asInt64();
+
+    if (conf->lowSpeedTime < 0 && config["low-speed-time"] != Json::Value())
+        conf->lowSpeedTime = config["low-speed-time"].asInt64();
 }
 
 /**
@@ -225,16 +267,39 @@ int main(int argc, char *argv[])
     if(conf.proxyurl)
         rc.setProxy(conf.proxyurl);
 
-    // setup speed limits
+    // setup speed limits, shared by all transfers
+    auto &scheduler = BandwidthScheduler::getInstance();
     if (conf.maxDownloadRate) {
-        rc.setMaxDownloadRate(conf.maxDownloadRate * 1024);
+        scheduler.setRate(BandwidthScheduler::Direction::DOWNLOAD, conf.maxDownloadRate * 1024);
     }
     if (conf.maxUploadRate) {
-        rc.setMaxUploadRate(conf.maxUploadRate * 1024);
+        scheduler.setRate(BandwidthScheduler::Direction::UPLOAD, conf.maxUploadRate * 1024);
     }
 
-    rc.login(acc); // authenticate one instance to populate pool
-    clientPool.populate(rc, 25);
+    // setup stall detection
+    if (conf.lowSpeedLimit >= 0 || conf.lowSpeedTime >= 0) {
+        rc.setLowSpeedLimit(conf.lowSpeedLimit >= 0 ? conf.lowSpeedLimit : 1024,
+                            conf.lowSpeedTime > 0 ? conf.lowSpeedTime : 30);
+    }
+
+    // session of previous mount saves full login
+    if (conf.sessionfile) {
+        MarcRestClient::setSessionFile(conf.sessionfile);
+    } else {
+        const char *cacheHome = getenv("XDG_CACHE_HOME");
+        std::string cacheBase = cacheHome && *cacheHome ? cacheHome : std::string(getpwuid(getuid())->pw_dir) + "/.cache";
+        // one file per account, mounts of different accounts don't overwrite each other's session
+        std::string login = conf.username;
+        std::replace(login.begin(), login.end(), '/', '_');
+        MarcRestClient::setSessionFile(cacheBase + "/marcfs/session-" + login + ".json");
+    }
+
+    // don't hold the mount, login when mounted, cloud calls wait for it
+    mountSetup = [&] {
+        if (!rc.resumeSession(acc))
+            rc.login(acc); // authenticate one instance to populate pool
+        clientPool.populate(rc, 2, 25); // the rest are copied from it when needed
+    };
 
     // initialize cache dir
     if (conf.cachedir) {
@@ -248,27 +313,44 @@ int main(int argc, char *argv[])
         cacheDir = conf.cachedir;
     }
 
+    uploadOnRelease = conf.uploadOnRelease;
+
+    // setup retry budget
+    if (conf.maxRetries >= 0) {
+        retryPolicy.maxRetries = static_cast<uint>(conf.maxRetries);
+    }
+    if (conf.retryDelay >= 0) {
+        retryPolicy.baseDelay = std::chrono::milliseconds(conf.retryDelay);
+    }
+
     // initialize FUSE
     static fuse_operations cloudfs_oper = {};
     cloudfs_oper.init = &initCallback;
+    cloudfs_oper.destroy = &destroyCallback;
     cloudfs_oper.getattr = &getattrCallback;
     cloudfs_oper.opendir = &opendirCallback;
     cloudfs_oper.readdir = &readdirCallback;
     cloudfs_oper.releasedir = &releasedirCallback;
+    cloudfs_oper.fsyncdir = &fsyncdirCallback;
     cloudfs_oper.open = &openCallback;
     cloudfs_oper.read = &readCallback;
     cloudfs_oper.write = &writeCallback;
     cloudfs_oper.flush = &flushCallback;
+    cloudfs_oper.fsync = &fsyncCallback;
     cloudfs_oper.release = &releaseCallback;
     cloudfs_oper.mkdir = &mkdirCallback;
     cloudfs_oper.rmdir = &rmdirCallback;
     cloudfs_oper.truncate = &truncateCallback;
+    cloudfs_oper.copy_file_range = &copyFileRangeCallback;
     cloudfs_oper.unlink = &unlinkCallback;
     cloudfs_oper.rename = &renameCallback;
     cloudfs_oper.statfs = &statfsCallback;
     cloudfs_oper.utimens = &utimensCallback;
     cloudfs_oper.mknod = &mknodCallback;
+    cloudfs_oper.create = &createCallback;
     cloudfs_oper.chmod = &chmodCallback;
+    cloudfs_oper.getxattr = &getxattrCallback;
+    cloudfs_oper.listxattr = &listxattrCallback;
 
     // start!
     return fuse_main(args.argc, args.argv, &cloudfs_oper, nullptr);
@@ -23,8 +23,8 @@
 #include <json/value.h>
 
 Shard::Shard(Json::Value const &shardEntity)
-    : url(shardEntity[0]["url"].asString()),
-      count(std::stoi(shardEntity[0]["count"].asString())) {
+    : url(shardEntity["url"].asString()),
+      count(std::stoi(shardEntity["count"].asString())) {
 }
 
 const std::string& Shard::getUrl() const {
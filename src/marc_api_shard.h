@@ -60,6 +60,10 @@ class Shard {
         }
     }
 
+    /**
+     * @brief Shard - construct from one host entry of dispatcher answer
+     * @param shardEntity - JSON object with url and count
+     */
     explicit Shard(const Json::Value &shardEntity);
 
     const std::string& getUrl() const;
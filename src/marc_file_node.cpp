@@ -25,9 +25,35 @@
 #include "marc_file_node.h"
 #include "memory_storage.h"
 #include "file_storage.h"
+#include "thread_pool.h"
+#include "utils.h"
 
 extern std::string cacheDir;
 
+void handleCompounds(std::vector<CloudFile> &files);
+std::string doTransfer(std::function<std::string(MarcRestClient *)> what);
+
+/**
+ * @brief SMALL_FILE_SIZE - files of this size or less get special handling from the cloud,
+ *        they are never streamed
+ */
+static const off_t SMALL_FILE_SIZE = 20;
+
+/**
+ * @brief STREAM_START_SIZE - streaming starts once sequential writer gets past this size.
+ *        Smaller files are uploaded in one go by flush, a thread and a connection aren't worth it
+ */
+static const off_t STREAM_START_SIZE = 8 << 20;
+
+/**
+ * @brief backgroundUploads - workers that upload sealed compound parts
+ *        while the writer still fills the rest of the file
+ */
+static ThreadPool& backgroundUploads() {
+    static ThreadPool workers(4);
+    return workers;
+}
+
 MarcFileNode::MarcFileNode() {
     if (cacheDir.empty()) {
         cachedContent.reset(new MemoryStorage);
@@ -53,7 +79,11 @@ void MarcFileNode::fillStat(struct stat *stbuf) {
 }
 
 void MarcFileNode::open(MarcRestClient *client, std::string path) {
-    // open is potentially network-download operation, lock it
+    openLazy();
+    fetch(client, path);
+}
+
+void MarcFileNode::openLazy() {
     std::unique_lock<std::mutex> guard(netMutex);
 
     if (opened) {
@@ -65,18 +95,73 @@ void MarcFileNode::open(MarcRestClient *client, std::string path) {
     cachedContent->open();
     opened = true;
 
-    // not a new file, need to download
+    // nothing to download for empty files
+    loaded = oldFileSize == 0;
+}
+
+void MarcFileNode::openNew() {
+    openLazy();
+
+    // file must appear in the cloud even if nothing is written to it
+    std::unique_lock<std::mutex> guard(netMutex);
+    remoteExists = false;
+    dirty = true;
+}
+
+void MarcFileNode::fetch(MarcRestClient *client, std::string path) {
+    // fetch is potentially network-download operation, lock it
+    std::unique_lock<std::mutex> guard(netMutex);
+
+    if (!opened || loaded) {
+        // already there, or nowhere to put it
+        return;
+    }
+
+    // not a new file, need to download. Content received by previous failed attempts is kept,
+    // continue right after it: part that was being downloaded is requested from the middle
+    off_t received = cachedContent->size();
+    if (received > 0) {
+        // received bytes may only be continued with the same content
+        std::string expected = remoteHash;
+        refreshRemote(client, path);
+        if (expected.empty() || remoteHash != expected) {
+            cachedContent->truncate(0);
+            received = 0;
+        }
+    }
     if (oldFileSize > MARCFS_MAX_FILE_SIZE) {
         // compound file
         off_t partCount = (oldFileSize / MARCFS_MAX_FILE_SIZE) + 1;     // let's say, file is 3GB, that gives us 2 parts
-        for (off_t idx = 0; idx < partCount; ++idx) {
+        for (off_t idx = received / MARCFS_MAX_FILE_SIZE; idx < partCount; ++idx) {
             std::string extendedPathname = std::string(path) + MARCFS_SUFFIX + std::to_string(idx);
-            client->download(extendedPathname, *cachedContent); // append part to current cache
+            off_t partSize = std::min(oldFileSize - idx * MARCFS_MAX_FILE_SIZE, MARCFS_MAX_FILE_SIZE);
+            off_t partReceived = std::max(received - idx * MARCFS_MAX_FILE_SIZE, off_t(0));
+            if (partReceived == 0) {
+                client->download(extendedPathname, *cachedContent); // append part to current cache
+            } else {
+                client->download(extendedPathname, *cachedContent, partReceived, partSize - partReceived);
+            }
         }
-    } else {
+    } else if (received == 0) {
         // single file
         client->download(path, *cachedContent);
+    } else if (received < oldFileSize) {
+        // single file, resumed
+        client->download(path, *cachedContent, received, oldFileSize - received);
+    }
+
+    if (static_cast<off_t>(cachedContent->size()) != oldFileSize) {
+        // file was changed in the cloud meanwhile, pieces may not fit together, start over
+        cachedContent->truncate(0);
+        throw MailApiException("Downloaded file size doesn't match, expected " + std::to_string(oldFileSize)
+                               + ", got " + std::to_string(cachedContent->size()));
     }
+
+    loaded = true;
+}
+
+bool MarcFileNode::needsDownload() const {
+    return opened && !loaded;
 }
 
 
@@ -88,35 +173,41 @@ void MarcFileNode::flush(MarcRestClient *client, std::string path) {
     if (!dirty)
         return;
 
-    // cachedContent.size() now holds current size, fileSize holds old size
-    if (oldFileSize > MARCFS_MAX_FILE_SIZE) {
-        // old one was compound file - delete old parts
-        off_t oldPartCount = (oldFileSize / MARCFS_MAX_FILE_SIZE) + 1;
-        for (off_t idx = 0; idx < oldPartCount; ++idx) {
-            std::string extendedPathname = std::string(path) + MARCFS_SUFFIX + std::to_string(idx);
-            client->remove(extendedPathname);
-        }
-    } else {
-        // old one was regular non-compound one, delete it
-        client->remove(path);
-    }
+    // let the streaming upload, if any, catch up with the writer
+    stopStream(true);
 
-    if (cachedContent->size() > MARCFS_MAX_FILE_SIZE) {
-        // new one is compound - upload new parts
-        off_t partCount = (cachedContent->size() / MARCFS_MAX_FILE_SIZE) + 1;
-        off_t offset = 0;
+    // cachedContent.size() now holds current size, fileSize holds old size.
+    // Parts uploaded by failed attempts are remembered, retries only link them again
+    off_t fileSize = cachedContent->size();
+    off_t partCount = 0;
+    if (fileSize > MARCFS_MAX_FILE_SIZE) {
+        // new one is compound - upload new parts, some of them may be already uploaded in background
+        partCount = (fileSize / MARCFS_MAX_FILE_SIZE) + 1;
         for (off_t idx = 0; idx < partCount; ++idx) {
             std::string extendedPathname = std::string(path) + MARCFS_SUFFIX + std::to_string(idx);
-            client->upload(extendedPathname, *cachedContent, offset, MARCFS_MAX_FILE_SIZE);
-            offset += MARCFS_MAX_FILE_SIZE;
+            off_t partSize = std::min(fileSize - idx * MARCFS_MAX_FILE_SIZE, MARCFS_MAX_FILE_SIZE);
+            client->addByHash(extendedPathname, partHash(client, idx, partSize), partSize);
         }
     } else {
         // single file
-        client->upload(path, *cachedContent);
+        client->addByHash(path, partHash(client, 0, fileSize), fileSize);
+    }
+
+    // new files have replaced old ones with the same names, remove what's left of the old layout
+    if (!remoteExists) {
+        // created locally, nothing to delete
+    } else if (oldFileSize > MARCFS_MAX_FILE_SIZE) {
+        // old one was compound file - delete parts past the new ones
+        off_t oldPartCount = (oldFileSize / MARCFS_MAX_FILE_SIZE) + 1;
+        removeParts(client, path, partCount, oldPartCount);
+    } else if (partCount > 0) {
+        // old one was regular non-compound one, new one is compound, delete it
+        client->remove(path);
     }
 
     // cleanup
     dirty = false;
+    remoteExists = true;
     oldFileSize = cachedContent->size();
 }
 
@@ -129,18 +220,212 @@ int MarcFileNode::write(const char *buf, size_t size, uint64_t offsetBytes) {
     if (res > 0) {
         dirty = true;
         mtime = time(nullptr);
+        streamWrite(res, static_cast<off_t>(offsetBytes));
+        trackWrite(static_cast<off_t>(offsetBytes), res);
     }
     return res;
 }
 
+void MarcFileNode::trackWrite(off_t offset, off_t size) {
+    std::lock_guard<std::mutex> guard(partsMutex);
+
+    // parts touched by this write can't use their background uploads anymore
+    off_t end = offset + size;
+    for (auto it = sealedParts.lower_bound(offset / MARCFS_MAX_FILE_SIZE); it != sealedParts.end(); ++it) {
+        if (it->first * MARCFS_MAX_FILE_SIZE >= end)
+            break;
+
+        it->second.stale = true;
+    }
+    uploadedParts.erase(uploadedParts.lower_bound(offset / MARCFS_MAX_FILE_SIZE),
+                        uploadedParts.lower_bound((end - 1) / MARCFS_MAX_FILE_SIZE + 1));
+
+    if (offset > sequentialEnd) {
+        // there's a gap, writer is not sequential
+        return;
+    }
+    sequentialEnd = std::max(sequentialEnd, end);
+    if (streaming) {
+        // parts are registered by the streaming upload
+        return;
+    }
+
+    // seal parts that are completely written, writer has moved past them.
+    // Stale ones are sealed again once the writer is done with them
+    AbstractStorage *storage = cachedContent.get();
+    for (off_t idx = 0; (idx + 1) * MARCFS_MAX_FILE_SIZE <= sequentialEnd; ++idx) {
+        auto sealed = sealedParts.find(idx);
+        bool touched = idx * MARCFS_MAX_FILE_SIZE < end && offset < (idx + 1) * MARCFS_MAX_FILE_SIZE;
+        if (sealed != sealedParts.end() && (!sealed->second.stale || touched))
+            continue;
+
+        // previous upload of this part may still read the content, new one goes after it
+        SealedPart &part = sealedParts[idx];
+        std::shared_future<std::string> previous = part.hash;
+        part.stale = false;
+        part.size = MARCFS_MAX_FILE_SIZE;
+        part.hash = backgroundUploads().enqueue([storage, idx, previous] {
+            if (previous.valid())
+                previous.wait();
+
+            return doTransfer([&](MarcRestClient *client) {
+                return client->uploadContent(*storage, idx * MARCFS_MAX_FILE_SIZE, MARCFS_MAX_FILE_SIZE);
+            });
+        }).share();
+    }
+}
+
+std::string MarcFileNode::partHash(MarcRestClient *client, off_t idx, off_t count) {
+    std::shared_future<std::string> uploaded;
+    {
+        std::lock_guard<std::mutex> guard(partsMutex);
+        auto flushed = uploadedParts.find(idx);
+        if (flushed != uploadedParts.end() && flushed->second.size == count) {
+            return flushed->second.hash;
+        }
+
+        auto sealed = sealedParts.find(idx);
+        if (sealed != sealedParts.end() && !sealed->second.stale && sealed->second.size == count) {
+            uploaded = sealed->second.hash;
+        }
+    }
+
+    std::string hash;
+    if (uploaded.valid()) {
+        try {
+            hash = uploaded.get();
+        } catch (std::exception &exc) {
+            // background upload failed, retry it here
+            std::cerr << "Background upload of part " << idx << " failed: " << exc.what() << std::endl;
+        }
+    }
+
+    if (hash.empty()) {
+        hash = client->uploadContent(*cachedContent, idx * MARCFS_MAX_FILE_SIZE, count);
+    }
+
+    // remember it in case flush fails later
+    std::lock_guard<std::mutex> guard(partsMutex);
+    uploadedParts[idx] = {hash, count};
+    return hash;
+}
+
+void MarcFileNode::streamWrite(off_t size, off_t offset) {
+    std::lock_guard<std::mutex> guard(streamMutex);
+    if (streamDisabled)
+        return;
+
+    if (offset != streamedEnd) {
+        // writer seeked, fall back to staged content
+        if (stream)
+            stream->abort();
+
+        streaming = false;
+        streamDisabled = true;
+        return;
+    }
+    streamedEnd += size;
+
+    if (!stream) {
+        if (streamedEnd <= STREAM_START_SIZE)
+            return;
+
+        // start streaming, it reads what was written before from staged content
+        stream = std::make_unique<StreamProgress>();
+        streaming = true;
+        streamUpload = std::async(std::launch::async, &MarcFileNode::streamParts, this, stream.get());
+    }
+
+    if (stream->isAborted()) {
+        // upload failed, fall back to staged content
+        streaming = false;
+        streamDisabled = true;
+        return;
+    }
+
+    // bytes are staged already, writer never waits for the upload
+    stream->advance(streamedEnd);
+}
+
+void MarcFileNode::streamParts(StreamProgress *progress) {
+    // failures are not retried here, flush uploads whatever is missing from staged content
+    AbstractStorage *storage = cachedContent.get();
+    try {
+        for (off_t idx = 0; progress->waitBeyond(idx * MARCFS_MAX_FILE_SIZE) > idx * MARCFS_MAX_FILE_SIZE; ++idx) {
+            // each part gets its own upload and client, limit it to maximum file size
+            off_t partStart = idx * MARCFS_MAX_FILE_SIZE;
+            off_t partSize = 0;
+            std::string hash = doTransfer([&](MarcRestClient *client) {
+                return client->uploadContent([&](char *target, size_t requested) -> ssize_t {
+                    off_t offset = partStart + partSize;
+                    off_t available = progress->waitBeyond(offset);
+                    if (available < 0)
+                        return -1;
+
+                    off_t wanted = std::min({static_cast<off_t>(requested), MARCFS_MAX_FILE_SIZE - partSize, available - offset});
+                    if (wanted == 0)
+                        return 0;
+
+                    int transferred = storage->read(target, wanted, offset);
+                    if (transferred <= 0)
+                        return -1; // truncated under us
+
+                    partSize += transferred;
+                    return transferred;
+                });
+            });
+
+            if (partSize <= SMALL_FILE_SIZE) {
+                // tail is too small, flush will handle it
+                continue;
+            }
+
+            // stream could be aborted by a write that touched this part, check under the lock
+            std::lock_guard<std::mutex> guard(partsMutex);
+            if (progress->isAborted())
+                return;
+
+            std::promise<std::string> uploaded;
+            uploaded.set_value(hash);
+            sealedParts[idx].size = partSize;
+            sealedParts[idx].hash = uploaded.get_future().share();
+        }
+    } catch (std::exception &exc) {
+        std::cerr << "Streaming upload failed: " << exc.what() << std::endl;
+        progress->abort(); // writer falls back to staged content
+    }
+}
+
+void MarcFileNode::stopStream(bool drain) {
+    std::lock_guard<std::mutex> guard(streamMutex);
+    if (!stream)
+        return;
+
+    if (drain) {
+        stream->close();
+    } else {
+        stream->abort();
+    }
+    streamUpload.wait();
+
+    // what's written after this point goes through staged content
+    stream.reset();
+    streaming = false;
+    streamDisabled = true;
+}
+
+void MarcFileNode::waitForSealedParts() {
+    std::lock_guard<std::mutex> guard(partsMutex);
+    for (auto &part : sealedParts) {
+        part.second.hash.wait();
+    }
+}
+
 void MarcFileNode::remove(MarcRestClient *client, std::string path) {
     if (oldFileSize > MARCFS_MAX_FILE_SIZE) {
         // compound file, remove each part
         off_t partCount = (oldFileSize / MARCFS_MAX_FILE_SIZE) + 1;
-        for (off_t idx = 0; idx < partCount; ++idx) {
-            std::string extendedPathname = std::string(path) + MARCFS_SUFFIX + std::to_string(idx);
-            client->remove(extendedPathname); // append part to current cache
-        }
+        removeParts(client, path, 0, partCount);
     } else {
         // single file
         client->remove(path);
@@ -163,22 +448,162 @@ void MarcFileNode::rename(MarcRestClient *client, std::string oldPath, std::stri
 }
 
 void MarcFileNode::truncate(off_t size) {
+    {
+        std::lock_guard<std::mutex> guard(streamMutex);
+        if (stream) {
+            // streaming upload can't follow truncation
+            stream->abort();
+            streaming = false;
+            streamDisabled = true;
+        } else {
+            // not started yet, it will pick up the head from staged content
+            streamedEnd = std::min(streamedEnd, size);
+        }
+    }
+
+    {
+        // parts that extend past the new end have different content now
+        std::lock_guard<std::mutex> guard(partsMutex);
+        for (auto &part : sealedParts) {
+            if ((part.first + 1) * MARCFS_MAX_FILE_SIZE > size)
+                part.second.stale = true;
+        }
+        uploadedParts.erase(uploadedParts.lower_bound(size / MARCFS_MAX_FILE_SIZE), uploadedParts.end());
+        sequentialEnd = std::min(sequentialEnd, size);
+    }
+
     cachedContent->truncate(size);
-    // truncate doesn't open file, set size accordingly
-    oldFileSize = size;
+    if (size == 0) {
+        // old content is not needed anymore, no need to download it
+        loaded = true;
+    }
     dirty = true;
 }
 
+void MarcFileNode::truncate(MarcRestClient *client, std::string path, off_t size) {
+    if (size > oldFileSize) {
+        // growing, new bytes are zeroes, upload them along with the old content
+        open(client, path);
+        truncate(size);
+        flush(client, path);
+        release();
+        return;
+    }
+
+    std::unique_lock<std::mutex> guard(netMutex);
+    if (size == oldFileSize)
+        return;
+
+    off_t oldPartCount = (oldFileSize / MARCFS_MAX_FILE_SIZE) + 1;
+    bool wasCompound = oldFileSize > MARCFS_MAX_FILE_SIZE;
+
+    if (size == 0) {
+        // truncate to zero - just replace with empty file
+        client->create(path);
+    } else if (size > MARCFS_MAX_FILE_SIZE) {
+        // still compound - rewrite last surviving part, drop the ones after it
+        off_t partCount = (size / MARCFS_MAX_FILE_SIZE) + 1;
+        off_t lastIdx = partCount - 1;
+        off_t lastSize = size - lastIdx * MARCFS_MAX_FILE_SIZE;
+        off_t oldLastSize = std::min(oldFileSize - lastIdx * MARCFS_MAX_FILE_SIZE, MARCFS_MAX_FILE_SIZE);
+        if (lastSize != oldLastSize) {
+            std::string lastPathname = path + MARCFS_SUFFIX + std::to_string(lastIdx);
+            client->addByHash(lastPathname, uploadHead(client, lastPathname, lastSize), lastSize);
+        }
+
+        removeParts(client, path, partCount, oldPartCount);
+        oldFileSize = size;
+        return;
+    } else {
+        // single file - take its head from the first part or old file itself
+        std::string sourcePathname = wasCompound ? path + MARCFS_SUFFIX + "0" : path;
+        client->addByHash(path, uploadHead(client, sourcePathname, size), size);
+    }
+
+    if (wasCompound) {
+        // new content is in place, old parts are not needed anymore
+        removeParts(client, path, 0, oldPartCount);
+    }
+    oldFileSize = size;
+}
+
+void MarcFileNode::removeParts(MarcRestClient *client, std::string path, off_t from, off_t to) {
+    // parts are independent, remove them all at once
+    std::vector<std::future<void>> removals;
+    for (off_t idx = from; idx < to; ++idx) {
+        removals.push_back(client->removeAsync(path + MARCFS_SUFFIX + std::to_string(idx)));
+    }
+
+    for (auto &removal : removals) {
+        removal.get();
+    }
+}
+
+std::string MarcFileNode::uploadHead(MarcRestClient *client, std::string remotePath, off_t count) {
+    // use content storage as a staging area, node is not opened
+    cachedContent->open();
+    ScopeGuard cleaner = [&] { cachedContent->clear(); };
+
+    client->download(remotePath, *cachedContent, 0, count);
+    return client->uploadContent(*cachedContent);
+}
+
 void MarcFileNode::release() {
     // this is called after all threads released the file
     std::unique_lock<std::mutex> guard(netMutex);
-    oldFileSize = cachedContent->size(); // set cached size to last content size before clearing
+    stopStream(false);
+    waitForSealedParts(); // background uploads may still read the content
+    sealedParts.clear();
+    uploadedParts.clear();
+    sequentialEnd = 0;
+    streamedEnd = 0;
+    streamDisabled = false;
+
+    if (loaded) {
+        oldFileSize = cachedContent->size(); // set cached size to last content size before clearing
+    }
     cachedContent->clear(); // forget contents of a node
     opened = false;
+    loaded = false;
+}
+
+void MarcFileNode::cloneFrom(MarcRestClient *client, std::string path, const std::vector<std::string> &hashes, off_t size) {
+    std::unique_lock<std::mutex> guard(netMutex);
+
+    // new parts are added first, rewriting old ones with the same names
+    off_t partCount = 0;
+    if (size > MARCFS_MAX_FILE_SIZE) {
+        partCount = static_cast<off_t>(hashes.size());
+        for (off_t idx = 0; idx < partCount; ++idx) {
+            std::string extendedPathname = path + MARCFS_SUFFIX + std::to_string(idx);
+            off_t partSize = std::min(size - idx * MARCFS_MAX_FILE_SIZE, MARCFS_MAX_FILE_SIZE);
+            client->addByHash(extendedPathname, hashes[idx], partSize);
+        }
+    } else {
+        // single file is replaced in place
+        client->addByHash(path, hashes.front(), size);
+    }
+
+    // then what's left of the old layout is removed, same as in flush
+    if (!remoteExists) {
+        // created locally, nothing to delete
+    } else if (oldFileSize > MARCFS_MAX_FILE_SIZE) {
+        off_t oldPartCount = (oldFileSize / MARCFS_MAX_FILE_SIZE) + 1;
+        removeParts(client, path, partCount, oldPartCount);
+    } else if (partCount > 0) {
+        client->remove(path);
+    }
+
+    // local content is obsolete, it'll be downloaded if needed
+    cachedContent->truncate(0);
+    oldFileSize = size;
+    remoteExists = true;
+    loaded = size == 0;
+    dirty = false;
 }
 
 off_t MarcFileNode::getSize() const {
-    if (!cachedContent->empty())
+    if (opened && loaded)
         return cachedContent->size();
 
     return oldFileSize;
@@ -195,3 +620,40 @@ void MarcFileNode::setMtime(time_t time) {
 bool MarcFileNode::isOpen() const {
     return opened;
 }
+
+bool MarcFileNode::isDirty() const {
+    return dirty;
+}
+
+bool MarcFileNode::isNew() const {
+    return !remoteExists;
+}
+
+void MarcFileNode::setRemote(bool exists, off_t size) {
+    std::unique_lock<std::mutex> guard(netMutex);
+    remoteExists = exists;
+    oldFileSize = size;
+}
+
+void MarcFileNode::setRemoteHash(std::string hash) {
+    std::unique_lock<std::mutex> guard(netMutex);
+    remoteHash = hash;
+}
+
+void MarcFileNode::refreshRemote(MarcRestClient *client, const std::string &path) {
+    auto slashPos = path.find_last_of('/');
+    std::string dirname = path.substr(0, slashPos);
+    std::string filename = path.substr(slashPos + 1);
+
+    auto contents = client->ls(dirname + "/");
+    handleCompounds(contents);
+
+    remoteHash.clear();
+    for (const CloudFile &cf : contents) {
+        if (cf.getName() == filename) {
+            remoteHash = cf.getHash();
+            oldFileSize = static_cast<off_t>(cf.getSize());
+            break;
+        }
+    }
+}
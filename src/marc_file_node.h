@@ -23,9 +23,13 @@
 
 #include <vector>
 #include <memory>
+#include <future>
+#include <atomic>
+#include <map>
 
 #include "marc_node.h"
 #include "abstract_storage.h"
+#include "stream_progress.h"
 
 class MarcRestClient;
 class CacheNode;
@@ -40,6 +44,32 @@ public:
     explicit MarcFileNode(const struct stat &stbuf);
 
     void open(MarcRestClient *client, std::string path);
+
+    /**
+     * @brief openLazy - open the file without downloading its content.
+     *        Content must be downloaded via @ref fetch before it's read or partially
+     *        overwritten, unless the file is truncated to zero first.
+     */
+    void openLazy();
+
+    /**
+     * @brief openNew - open the file that doesn't exist in the cloud yet.
+     *        It's kept locally until the first @ref flush.
+     */
+    void openNew();
+
+    /**
+     * @brief fetch - download content of the file opened via @ref openLazy.
+     *        Does nothing if content is already there. If previous call failed midway,
+     *        download continues from the bytes received by it, unless the file has changed
+     *        in the cloud since then, see @ref setRemoteHash.
+     */
+    void fetch(MarcRestClient *client, std::string path);
+
+    /**
+     * @brief needsDownload - check whether file is opened but its content is not yet downloaded
+     */
+    bool needsDownload() const;
     void flush(MarcRestClient *client, std::string path);
     int read(char *buf, size_t size, uint64_t offsetBytes);
     int write(const char *buf, size_t size, uint64_t offsetBytes);
@@ -47,15 +77,165 @@ public:
     void rename(MarcRestClient *client, std::string oldPath, std::string newPath) override;
     void fillStat(struct stat *stbuf) override;
     void truncate(off_t size);
+
+    /**
+     * @brief truncate - truncate the file that is not opened, right in the cloud.
+     *        Truncation to zero and shrinking don't download the whole file: trailing
+     *        parts are removed and only the last surviving part is rewritten.
+     * @param client - client to perform requests with
+     * @param path - path to the file
+     * @param size - requested size of the file
+     */
+    void truncate(MarcRestClient *client, std::string path, off_t size);
     void release();
 
+    /**
+     * @brief cloneFrom - make this file a server-side copy of another one by content hashes,
+     *        no content is transferred. Local content is dropped, file becomes lazily loaded.
+     * @param client - client to perform requests with
+     * @param path - path to this file
+     * @param hashes - hashes of source parts, single one for non-compound file
+     * @param size - size of source file
+     */
+    void cloneFrom(MarcRestClient *client, std::string path, const std::vector<std::string> &hashes, off_t size);
+
     off_t getSize() const;
     time_t getMtime() const;
     void setMtime(time_t mtime);
 
     bool isOpen() const;
 
+    /**
+     * @brief isDirty - check whether file has changes that are not uploaded yet
+     */
+    bool isDirty() const;
+
+    /**
+     * @brief isNew - check whether file was created locally and never flushed
+     */
+    bool isNew() const;
+
+    /**
+     * @brief setRemote - set what @ref flush finds in the cloud at the path it uploads to
+     * @param exists - whether there is a file at that path
+     * @param size - size of that file, parts of it that new content doesn't overwrite
+     *        are removed after upload
+     */
+    void setRemote(bool exists, off_t size);
+
+    /**
+     * @brief setRemoteHash - set content hash of the file in the cloud at the moment
+     *        it's opened. Download is resumed only if the file still has this hash,
+     *        without it failed downloads are started over.
+     * @param hash - content hash, part hashes joined with ',' for compound files
+     */
+    void setRemoteHash(std::string hash);
+
 private:
+    /**
+     * @brief The SealedPart struct - compound part that was completely written
+     *        by a sequential writer and is being uploaded in background.
+     */
+    struct SealedPart {
+        /**
+         * @brief hash - becomes ready with content hash once upload is finished
+         */
+        std::shared_future<std::string> hash;
+
+        /**
+         * @brief stale - set if writer touched this part after it was sealed,
+         *        uploaded content can't be used in this case. Part is sealed
+         *        and uploaded again once the writer moves on to other parts.
+         */
+        bool stale = false;
+
+        /**
+         * @brief size - size of uploaded content
+         */
+        off_t size = 0;
+    };
+
+    /**
+     * @brief removeParts - remove range of compound parts from the cloud, in parallel
+     * @param client - client to perform requests with
+     * @param path - path to the compound file
+     * @param from - index of first part to remove
+     * @param to - index after the last part to remove
+     */
+    static void removeParts(MarcRestClient *client, std::string path, off_t from, off_t to);
+
+    /**
+     * @brief uploadHead - upload first bytes of a remote file as a new object
+     * @param client - client to perform requests with
+     * @param remotePath - remote path of the file to take the bytes from
+     * @param count - number of bytes to take
+     * @return hash of uploaded content
+     */
+    std::string uploadHead(MarcRestClient *client, std::string remotePath, off_t count);
+
+    /**
+     * @brief refreshRemote - list the file in the cloud again, updating @ref remoteHash
+     *        and @ref oldFileSize. Hash is cleared if the file is not there.
+     * @param client - client to perform requests with
+     * @param path - path to the file
+     */
+    void refreshRemote(MarcRestClient *client, const std::string &path);
+
+    /**
+     * @brief trackWrite - update sequential write tracking and start background
+     *        uploads of compound parts that were completely written
+     * @param offset - offset of the written range
+     * @param size - size of the written range
+     */
+    void trackWrite(off_t offset, off_t size);
+
+    /**
+     * @brief The UploadedPart struct - part uploaded by previous flush, possibly failed one.
+     *        Flush retries link it again without repeating the upload.
+     */
+    struct UploadedPart {
+        std::string hash;
+        off_t size = 0;
+    };
+
+    /**
+     * @brief partHash - obtain hash of compound part content, uploading it if
+     *        there is no usable result from previous flush or background upload.
+     * @param client - client to upload part with
+     * @param idx - index of part
+     * @param count - size of the part
+     * @return content hash of the part
+     */
+    std::string partHash(MarcRestClient *client, off_t idx, off_t count);
+
+    /**
+     * @brief streamWrite - announce staged bytes to the streaming upload, starting it if needed.
+     *        Streaming is dropped as soon as the writer leaves the sequential pattern.
+     * @param size - count of written bytes
+     * @param offset - offset of the write
+     */
+    void streamWrite(off_t size, off_t offset);
+
+    /**
+     * @brief streamParts - upload staged content part by part while it's being written,
+     *        runs in a separate thread
+     * @param progress - how far the writer has got
+     */
+    void streamParts(StreamProgress *progress);
+
+    /**
+     * @brief stopStream - stop the streaming upload and wait for it to finish
+     * @param drain - if true, all the bytes written so far are uploaded before stopping,
+     *        otherwise the stream is aborted
+     */
+    void stopStream(bool drain);
+
+    /**
+     * @brief waitForSealedParts - wait until all background uploads are finished.
+     *        Must be called before content storage is cleared.
+     */
+    void waitForSealedParts();
+
     /**
      * @brief cachedContent - backing storage for open-write/read-release sequence
      */
@@ -64,13 +244,21 @@ private:
     /**
      * @brief dirty - used to indicate whether subsequent upload is needed
      */
-    bool dirty = false;
+    std::atomic_bool dirty = false;
 
     /**
      * @brief oldFileSize - holds size that was passed from cloud (or sum of compounds)
      */
     off_t oldFileSize = 0;
 
+    /**
+     * @brief remoteHash - content hash of the file in the cloud that is being downloaded,
+     *        empty if unknown
+     *
+     * Guarded by mutex @ref netMutex
+     */
+    std::string remoteHash;
+
     /**
      * @brief mtime - modification time of this file
      */
@@ -94,6 +282,85 @@ private:
      * Guarded by mutex @ref netMutex
      */
     bool opened = false;
+
+    /**
+     * @brief remoteExists - false for files created locally and not yet flushed,
+     *        there's nothing to remove in the cloud for them
+     */
+    bool remoteExists = true;
+
+    /**
+     * @brief loaded - whether @ref cachedContent holds actual content of the opened file.
+     *        Lazily opened files don't have it until @ref fetch or truncation to zero.
+     */
+    std::atomic_bool loaded = false;
+
+    /**
+     * @brief sequentialEnd - end of the range that was written contiguously from the start.
+     *        Parts that lie completely below it are sealed and uploaded in background.
+     *
+     * Guarded by mutex @ref partsMutex
+     */
+    off_t sequentialEnd = 0;
+
+    /**
+     * @brief sealedParts - background uploads of compound parts, by part index
+     *
+     * Guarded by mutex @ref partsMutex
+     */
+    std::map<off_t, SealedPart> sealedParts;
+
+    /**
+     * @brief uploadedParts - parts uploaded by flushes, by part index.
+     *        Parts are dropped from here when written to or truncated.
+     *
+     * Guarded by mutex @ref partsMutex
+     */
+    std::map<off_t, UploadedPart> uploadedParts;
+
+    /**
+     * @brief stream - progress of a sequential writer, streaming upload follows it
+     *        reading staged content
+     *
+     * Guarded by mutex @ref streamMutex
+     */
+    std::unique_ptr<StreamProgress> stream;
+
+    /**
+     * @brief streamUpload - upload that consumes @ref stream
+     */
+    std::future<void> streamUpload;
+
+    /**
+     * @brief streamedEnd - count of bytes the writer has written sequentially so far
+     *
+     * Guarded by mutex @ref streamMutex
+     */
+    off_t streamedEnd = 0;
+
+    /**
+     * @brief streamDisabled - writer is not sequential, use staged content only
+     *
+     * Guarded by mutex @ref streamMutex
+     */
+    bool streamDisabled = false;
+
+    /**
+     * @brief streaming - whether streaming upload is in progress. While it is,
+     *        compound parts are registered by the stream itself.
+     */
+    std::atomic_bool streaming = false;
+
+    /**
+     * @brief streamMutex - keeps stream progress in order of writes
+     */
+    std::mutex streamMutex;
+
+    /**
+     * @brief partsMutex - guards sequential write tracking, writes
+     *                     may come from several threads at once
+     */
+    mutable std::mutex partsMutex;
 };
 
 #endif // MARC_FILE_NODE_H
@@ -26,17 +26,39 @@
 #include <memory>
 #include <algorithm>
 #include <string>
+#include <mutex>
+#include <condition_variable>
+#include <map>
+#include <chrono>
+#include <random>
+#include <fstream>
+#include <filesystem>
+#include <cstring>
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "curl_header.h"
 
 #include "marc_rest_client.h"
 #include "abstract_storage.h"
+#include "transfer_engine.h"
+#include "retry_policy.h"
+#include "bandwidth_scheduler.h"
 
 #define NV_PAIR(name, value) curl_pair<CURLformoption, std::string>(CURLFORM_COPYNAME, name), \
                              curl_pair<CURLformoption, std::string>(CURLFORM_COPYCONTENTS, value.c_str())
 
 using namespace curl;
 
+/**
+ * @brief MAX_STALL_RESTARTS - how many times stalled transfer is restarted in place,
+ *        before giving up and leaving it to the caller
+ */
+static const int MAX_STALL_RESTARTS = 3;
+
 static const std::string SAFE_USER_AGENT = "Mozilla/5.0 (Windows NT 10.0; rv:78.0) Gecko/20100101 Firefox/78.0";
 
 static const std::string MAIN_DOMAIN = "https://mail.ru";
@@ -47,6 +69,7 @@ static const std::string AUTH_ENDPOINT = AUTH_DOMAIN + "/jsapi/auth";
 static const std::string SCLD_COOKIE_ENDPOINT = AUTH_DOMAIN + "/sdc";
 
 static const std::string SCLD_SHARD_ENDPOINT = CLOUD_DOMAIN + "/api/v2/dispatcher";
+static const auto SHARD_CACHE_TTL = std::chrono::minutes(5); // dispatcher answer is reused for this long
 
 static const std::string SCLD_FOLDER_ENDPOINT = CLOUD_DOMAIN + "/api/v2/folder";
 static const std::string SCLD_FILE_ENDPOINT = CLOUD_DOMAIN + "/api/v2/file";
@@ -61,6 +84,8 @@ static const std::string SCLD_ADDFOLDER_ENDPOINT = SCLD_FOLDER_ENDPOINT + "/add"
 
 const std::string SCLD_PUBLICLINK_ENDPOINT = CLOUD_DOMAIN + "/public";
 
+static const std::string ZERO_HASH = "0000000000000000000000000000000000000000";
+
 static std::string toPadded40Hex(const std::string& s) {
     if (s.length() >= 40) {
         throw MailApiException("String is too long");
@@ -79,11 +104,88 @@ static std::string toPadded40Hex(const std::string& s) {
     return ret.str();
 }
 
+/**
+ * @brief The SharedState struct - caches shared by all clients: DNS, TLS sessions,
+ *        connections and cookies. New handles reuse warm connections and resume TLS.
+ */
+struct SharedState {
+    SharedState() {
+        curl_share_setopt(handle, CURLSHOPT_LOCKFUNC, lock);
+        curl_share_setopt(handle, CURLSHOPT_UNLOCKFUNC, unlock);
+        curl_share_setopt(handle, CURLSHOPT_USERDATA, this);
+        curl_share_setopt(handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+        curl_share_setopt(handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+        curl_share_setopt(handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_COOKIE);
+    }
+
+    static void lock(CURL */*handle*/, curl_lock_data data, curl_lock_access /*access*/, void *userp) {
+        static_cast<SharedState *>(userp)->locks[data].lock();
+    }
+
+    static void unlock(CURL */*handle*/, curl_lock_data data, void *userp) {
+        static_cast<SharedState *>(userp)->locks[data].unlock();
+    }
+
+    CURLSH *handle = curl_share_init();
+    std::mutex locks[CURL_LOCK_DATA_LAST];
+};
+
+/**
+ * @brief The AuthSession struct - session tokens shared by all clients. Cookies of the session
+ *        are in @ref SharedState. While one client renews the session, others wait for it.
+ */
+struct AuthSession {
+    std::mutex mutex;
+    std::condition_variable renewed;
+
+    std::string csrfToken;
+    std::string file;               // where session is saved, none if empty
+    uint64_t generation = 0;        // incremented each time session is renewed
+    bool renewing = false;
+    const MarcRestClient *renewer = nullptr;
+};
+
+static AuthSession &authSession() {
+    static AuthSession session;
+    return session;
+}
+
+/**
+ * @brief sharedState - obtain caches shared by all clients. Never destroyed,
+ *        as clients in static pools may outlive it on exit.
+ */
+static CURLSH * sharedState() {
+    static SharedState *state = new SharedState;
+    return state->handle;
+}
+
+/**
+ * @brief makeHeaders - build header list once, to be reused by many requests
+ */
+static curl_slist * makeHeaders(std::initializer_list<std::string> lines) {
+    curl_slist *headers = nullptr;
+    for (const std::string &line : lines) {
+        headers = curl_slist_append(headers, line.data());
+    }
+    return headers;
+}
+
+/**
+ * @brief appendResponse - default write function, appends to std::string passed as @param userp
+ */
+static size_t appendResponse(char *contents, size_t size, size_t nmemb, void *userp) {
+    static_cast<std::string *>(userp)->append(contents, size * nmemb);
+    return size * nmemb;
+}
+
 MarcRestClient::MarcRestClient()
     : restClient(std::make_unique<curl::curl_easy>()),
       cookieStore(*restClient) {
+    curl_easy_setopt(restClient->get_curl(), CURLOPT_SHARE, sharedState()); // survives reset
     cookieStore.set_file("");   // init cookie engine
     restClient->reset();        // reset debug->std:cout function
+    applyDefaults();
 }
 
 
@@ -91,146 +193,346 @@ MarcRestClient::MarcRestClient(MarcRestClient &toCopy)
     : restClient(std::make_unique<curl::curl_easy>(*toCopy.restClient.get())), // copy easy handle
       cookieStore(*restClient),                             // cokie_store is not copyable, init in body
       proxyUrl(toCopy.proxyUrl),
-      maxUploadRate(toCopy.maxUploadRate),
-      maxDownloadRate(toCopy.maxDownloadRate),
-      authAccount(toCopy.authAccount),                      // copy account from other one
-      actToken(toCopy.actToken),                            // copy auth token from other one
-      csrfToken(toCopy.csrfToken) {
-    for (const auto &c : toCopy.cookieStore.get()) {
-        restClient->add<CURLOPT_COOKIELIST>(c.data());
-    }
+      lowSpeedLimit(toCopy.lowSpeedLimit),
+      lowSpeedTime(toCopy.lowSpeedTime),
+      authAccount(toCopy.authAccount) {                     // copy account from other one, tokens are shared
+    // copied handle doesn't inherit share, cookies come from there too
+    curl_easy_setopt(restClient->get_curl(), CURLOPT_SHARE, sharedState());
     cookieStore.set_file("");                   // init cookie engine
+    applyDefaults();                            // copied options still point to buffers of the original
 }
 
 void MarcRestClient::setProxy(std::string proxyUrl) {
     this->proxyUrl = proxyUrl;
+    applyDefaults();
+}
+
+void MarcRestClient::setLowSpeedLimit(long limit, long time) {
+    this->lowSpeedLimit = limit;
+    this->lowSpeedTime = time;
+    applyDefaults();
+}
+
+void MarcRestClient::applyDefaults() {
+    CURL *handle = restClient->get_curl();
+    curl_easy_setopt(handle, CURLOPT_PROXY, proxyUrl.empty() ? nullptr : proxyUrl.data());
+    curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT, 10L);
+    curl_easy_setopt(handle, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(handle, CURLOPT_TIMEOUT, 0L);
+    curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS); // HTTP/2 if server agrees
+    curl_easy_setopt(handle, CURLOPT_USERAGENT, SAFE_USER_AGENT.data());  // 403 without this
+    curl_easy_setopt(handle, CURLOPT_VERBOSE, static_cast<long>(verbose));
+    curl_easy_setopt(handle, CURLOPT_DEBUGFUNCTION, trace_post);
+    curl_easy_setopt(handle, CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(handle, CURLOPT_XFERINFOFUNCTION, checkProgress);
+    curl_easy_setopt(handle, CURLOPT_XFERINFODATA, this);
+    resetRequest();
 }
 
-void MarcRestClient::setMaxDownloadRate(uint64_t rate) {
-    this->maxDownloadRate = rate;
+void MarcRestClient::resetRequest() {
+    CURL *handle = restClient->get_curl();
+    curl_easy_setopt(handle, CURLOPT_POSTFIELDSIZE, -1L);
+    curl_easy_setopt(handle, CURLOPT_POSTFIELDS, nullptr);
+    curl_easy_setopt(handle, CURLOPT_HTTPPOST, nullptr);
+    curl_easy_setopt(handle, CURLOPT_UPLOAD, 0L);
+    curl_easy_setopt(handle, CURLOPT_READFUNCTION, nullptr);
+    curl_easy_setopt(handle, CURLOPT_READDATA, nullptr);
+    curl_easy_setopt(handle, CURLOPT_RANGE, nullptr);
+    curl_easy_setopt(handle, CURLOPT_FRESH_CONNECT, 0L);
+    curl_easy_setopt(handle, CURLOPT_PIPEWAIT, 0L);
+    curl_easy_setopt(handle, CURLOPT_HTTPHEADER, nullptr);
+    curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, appendResponse);
+    curl_easy_setopt(handle, CURLOPT_WRITEDATA, &response);
+    curl_easy_setopt(handle, CURLOPT_HTTPGET, 1L); // post options above switch method to POST
+    progress = StallDetector();
 }
 
-void MarcRestClient::setMaxUploadRate(uint64_t rate) {
-    this->maxUploadRate = rate;
+int MarcRestClient::checkProgress(void *clientp, curl_off_t /*dltotal*/, curl_off_t dlnow, curl_off_t /*ultotal*/, curl_off_t ulnow) {
+    auto client = static_cast<MarcRestClient *>(clientp);
+    StallDetector &progress = client->progress;
+    if (!progress.enabled || client->lowSpeedLimit <= 0)
+        return 0;
+
+    auto now = std::chrono::steady_clock::now();
+    auto waited = progress.flow ? progress.flow->waited : std::chrono::steady_clock::duration();
+    curl_off_t transferred = dlnow + ulnow;
+    if (progress.since == std::chrono::steady_clock::time_point()) {
+        // first call, request has just started
+        progress.since = now;
+        progress.waited = waited;
+        progress.transferred = transferred;
+        return 0;
+    }
+
+    auto active = (now - progress.since) - (waited - progress.waited);
+    if (active < std::chrono::seconds(client->lowSpeedTime))
+        return 0;
+
+    if (transferred - progress.transferred < client->lowSpeedLimit * client->lowSpeedTime) {
+        progress.stalled = true;
+        return 1; // abort
+    }
+
+    // fast enough, start next window
+    progress.since = now;
+    progress.waited = waited;
+    progress.transferred = transferred;
+    return 0;
 }
 
-std::string MarcRestClient::paramString(Params const &params) {
-    if (params.empty())
-        return "";
+/**
+ * @brief appendEscaped - percent-encode @param value into @param target,
+ *        keeping only unreserved characters as is, same as curl_easy_escape
+ */
+static void appendEscaped(std::string &target, std::string_view value) {
+    static const char HEX[] = "0123456789ABCDEF";
+    for (unsigned char c : value) {
+        if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '-' || c == '.' || c == '_' || c == '~') {
+            target.push_back(static_cast<char>(c));
+            continue;
+        }
+
+        target.push_back('%');
+        target.push_back(HEX[c >> 4]);
+        target.push_back(HEX[c & 0xF]);
+    }
+}
 
-    std::vector<std::string> result;
-    result.reserve(params.size());
-    for (auto it = params.cbegin(); it != params.end(); ++it) {
-        std::string name = it->first, value = it->second;
-        if (name.empty())
+void MarcRestClient::appendParams(std::string &target, Params params) {
+    for (const auto &param : params) {
+        if (param.first.empty())
             continue;
 
-        restClient->escape(name);
-        restClient->escape(value);
-        std::string argument = value.empty() ? name : name + "=" + value;
-        result.push_back(argument);
+        appendEscaped(target, param.first);
+        if (!param.second.empty()) {
+            target.push_back('=');
+            appendEscaped(target, param.second);
+        }
+        target.push_back('&');
     }
+}
 
-    std::stringstream s;
-    copy(result.cbegin(), result.cend(), std::ostream_iterator<std::string>(s, "&"));
-    return s.str();
+std::string MarcRestClient::paramString(Params params) {
+    std::string result;
+    appendParams(result, params);
+    return result;
 }
 
-std::string MarcRestClient::performAction(curl::curl_header *forced_headers) {
-    std::ostringstream stream;
-    curl_ios<std::ostringstream> writer(stream);
+void MarcRestClient::setUrl(std::string_view url, Params query, std::string_view endpoint) {
+    this->endpoint.assign(endpoint.empty() ? url.substr(0, url.find('?')) : endpoint);
 
-    curl::curl_header header;
-    if (forced_headers) {
-        // we have forced headers, override defaults with them
-        header = *forced_headers;
-    } else {
-        // no forced headers, populate with defaults
-        header.add("Accept: */*");
-        header.add("Origin: " + CLOUD_DOMAIN);
-        header.add("Referer: " + CLOUD_DOMAIN);
+    urlBuffer.assign(url);
+    if (query.size() != 0) {
+        urlBuffer.push_back('?');
+        appendParams(urlBuffer, query);
+    }
+    curl_easy_setopt(restClient->get_curl(), CURLOPT_URL, urlBuffer.data());
+}
+
+void MarcRestClient::setPostFields(Params params) {
+    postBuffer.clear();
+    appendParams(postBuffer, params);
+
+    // not copied by cURL, buffer must stay intact until request is performed
+    CURL *handle = restClient->get_curl();
+    curl_easy_setopt(handle, CURLOPT_POSTFIELDSIZE, static_cast<long>(postBuffer.size()));
+    curl_easy_setopt(handle, CURLOPT_POSTFIELDS, postBuffer.data());
+}
+
+void MarcRestClient::syncSession() {
+    AuthSession &session = authSession();
+    std::unique_lock<std::mutex> lock(session.mutex);
+    session.renewed.wait(lock, [&] { return !session.renewing || session.renewer == this; });
+    sessionGeneration = session.generation;
+    if (apiHeaders && session.csrfToken == csrfToken)
+        return;
 
-        if (!csrfToken.empty()) {
-            header.add("X-CSRF-Token: " + csrfToken);
+    csrfToken = session.csrfToken;
+    curl_slist *headers = makeHeaders({"Accept: */*", "Origin: " + CLOUD_DOMAIN, "Referer: " + CLOUD_DOMAIN});
+    if (!csrfToken.empty()) {
+        headers = curl_slist_append(headers, ("X-CSRF-Token: " + csrfToken).data());
+    }
+    apiHeaders.reset(headers);
+}
+
+const std::string &MarcRestClient::performAction(curl_slist *forced_headers, bool multiplexed) {
+    ScopeGuard resetter = [&] { resetRequest(); };
+    syncSession();
+    response.clear();
+
+    // forced headers override defaults
+    restClient->add<CURLOPT_HTTPHEADER>(forced_headers ? forced_headers : apiHeaders.get());
+
+    auto &breaker = CircuitBreaker::getInstance();
+    if (!breaker.allow(endpoint))
+        throw CircuitOpenException(endpoint);
+
+    CURLcode res = CURLE_OK;
+    if (multiplexed) {
+        // wait for existing HTTP/2 connection instead of opening a new one
+        restClient->add<CURLOPT_PIPEWAIT>(1L);
+        res = TransferEngine::getInstance().submit(restClient->get_curl()).get();
+    } else {
+        try {
+            restClient->perform();
+        } catch (curl::curl_easy_exception &error) {
+            error.print_traceback();
+            res = static_cast<CURLcode>(error.get_code());
         }
     }
 
-    ScopeGuard resetter = [&] { restClient->reset(); };
-    if (!this->proxyUrl.empty())
-        restClient->add<CURLOPT_PROXY>(this->proxyUrl.data());
-    if (this->maxUploadRate)
-        restClient->add<CURLOPT_MAX_SEND_SPEED_LARGE>(this->maxUploadRate);
-
-    restClient->add<CURLOPT_CONNECTTIMEOUT>(10L);
-    restClient->add<CURLOPT_TCP_KEEPALIVE>(1L);
-    restClient->add<CURLOPT_FOLLOWLOCATION>(1L);
-    restClient->add<CURLOPT_TIMEOUT>(0L);
-    restClient->add<CURLOPT_NOSIGNAL>(1L);
-    restClient->add<CURLOPT_HTTPHEADER>(header.get());
-    restClient->add<CURLOPT_USERAGENT>(SAFE_USER_AGENT.data());  // 403 without this
-    restClient->add<CURLOPT_VERBOSE>(verbose);
-    restClient->add<CURLOPT_DEBUGFUNCTION>(trace_post);
-
-    restClient->add<CURLOPT_WRITEFUNCTION>(writer.get_function());
-    restClient->add<CURLOPT_WRITEDATA>(writer.get_stream());
-    try {
-        restClient->perform();
-    } catch (curl::curl_easy_exception &error) {
-        error.print_traceback();
-        throw MailApiException("Couldn't perform request!");
+    if (res == CURLE_ABORTED_BY_CALLBACK) {
+        // stalls are restarted by the caller, it records them if restarts don't help
+        if (progress.stalled)
+            throw TransferStalledException();
+
+        // stopped by our own callback, e.g. streaming writer has seeked, endpoint is fine
+        throw MailApiException("Request aborted by caller");
+    }
+    if (res != CURLE_OK) {
+        breaker.record(endpoint, 0);
+        throw TransportException(std::string("Couldn't perform request: ") + curl_easy_strerror(res));
     }
+
     int64_t ret = restClient->get_info<CURLINFO_RESPONSE_CODE>().get();
+    breaker.record(endpoint, ret);
     if (ret != 302 && ret != 200 && ret != 201) {  // OK or redirect
-        throw MailApiException("Non-success return code! Error message body: " + stream.str(), ret);
+        throw MailApiException("Non-success return code! Error message body: " + response, ret);
     }
 
-    return stream.str();
+    return response;
 }
 
-void MarcRestClient::performGet(AbstractStorage &target) {
-    curl::curl_header header;
-    header.add("Accept: */*");
-    header.add("Origin: " + CLOUD_DOMAIN);
+/**
+ * @brief The AsyncRequest struct - state of transient request, lives until it's completed
+ */
+struct AsyncRequest {
+    CURL *handle = curl_easy_init();
+    curl_slist *headers = nullptr;
+    std::string body;
+    std::promise<std::string> result;
+
+    ~AsyncRequest() {
+        curl_slist_free_all(headers);
+        curl_easy_cleanup(handle);
+    }
+};
+
+std::future<std::string> MarcRestClient::performAsync(std::string url, std::string postFields) {
+    syncSession();
+    auto request = std::make_shared<AsyncRequest>();
+    // own copy, client may rebuild its list while request is in flight
+    for (curl_slist *header = apiHeaders.get(); header; header = header->next) {
+        request->headers = curl_slist_append(request->headers, header->data);
+    }
 
-    ScopeGuard resetter = [&] { restClient->reset(); };
+    CURL *handle = request->handle;
+    curl_easy_setopt(handle, CURLOPT_URL, url.data());
+    if (!postFields.empty())
+        curl_easy_setopt(handle, CURLOPT_COPYPOSTFIELDS, postFields.data());
     if (!this->proxyUrl.empty())
-        restClient->add<CURLOPT_PROXY>(this->proxyUrl.data());
-    if (this->maxDownloadRate)
-        restClient->add<CURLOPT_MAX_RECV_SPEED_LARGE>(this->maxDownloadRate);
-    restClient->add<CURLOPT_CONNECTTIMEOUT>(10L);
-    restClient->add<CURLOPT_TCP_KEEPALIVE>(1L);
-    restClient->add<CURLOPT_FOLLOWLOCATION>(1L);
-    restClient->add<CURLOPT_TIMEOUT>(0L);
-    restClient->add<CURLOPT_NOSIGNAL>(1L);
-    restClient->add<CURLOPT_HTTPHEADER>(header.get());
-    restClient->add<CURLOPT_USERAGENT>(SAFE_USER_AGENT.data()); // 403 without this
-    restClient->add<CURLOPT_VERBOSE>(verbose);
-    restClient->add<CURLOPT_DEBUGFUNCTION>(trace_post);
-
-    restClient->add<CURLOPT_WRITEDATA>(&target);
+        curl_easy_setopt(handle, CURLOPT_PROXY, this->proxyUrl.data());
+
+    curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT, 10L);
+    curl_easy_setopt(handle, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(handle, CURLOPT_LOW_SPEED_LIMIT, lowSpeedLimit);
+    curl_easy_setopt(handle, CURLOPT_LOW_SPEED_TIME, lowSpeedTime);
+    curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(handle, CURLOPT_PIPEWAIT, 1L);
+    curl_easy_setopt(handle, CURLOPT_HTTPHEADER, request->headers);
+    curl_easy_setopt(handle, CURLOPT_USERAGENT, SAFE_USER_AGENT.data());  // 403 without this
+    curl_easy_setopt(handle, CURLOPT_VERBOSE, static_cast<long>(verbose));
+    curl_easy_setopt(handle, CURLOPT_DEBUGFUNCTION, trace_post);
+
+    // cookies and warm connections come from shared state
+    curl_easy_setopt(handle, CURLOPT_SHARE, sharedState());
+    curl_easy_setopt(handle, CURLOPT_COOKIEFILE, "");
+
+    curl_easy_setopt(handle, CURLOPT_WRITEDATA, &request->body);
+    curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, appendResponse);
+
+    auto answer = request->result.get_future();
+    std::string asyncEndpoint = url.substr(0, url.find('?'));
+    if (!CircuitBreaker::getInstance().allow(asyncEndpoint)) {
+        request->result.set_exception(std::make_exception_ptr(CircuitOpenException(asyncEndpoint)));
+        return answer;
+    }
+
+    TransferEngine::getInstance().submit(handle, [request, asyncEndpoint](CURLcode res, CURL *handle) {
+        if (res != CURLE_OK) {
+            CircuitBreaker::getInstance().record(asyncEndpoint, 0);
+            auto error = TransportException(std::string("Couldn't perform request: ") + curl_easy_strerror(res));
+            request->result.set_exception(std::make_exception_ptr(error));
+            return;
+        }
+
+        long ret = 0;
+        curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &ret);
+        CircuitBreaker::getInstance().record(asyncEndpoint, ret);
+        if (ret != 302 && ret != 200 && ret != 201) {  // OK or redirect
+            auto error = MailApiException("Non-success return code! Error message body: " + request->body, ret);
+            request->result.set_exception(std::make_exception_ptr(error));
+            return;
+        }
+
+        request->result.set_value(std::move(request->body));
+    });
+    return answer;
+}
+
+struct WriteData {
+    AbstractStorage * const content;  // content to append to
+    BandwidthScheduler::Flow flow;    // share of download rate limit
+};
+
+int64_t MarcRestClient::performGet(AbstractStorage &target) {
+    static curl_slist *getHeaders = makeHeaders({"Accept: */*", "Origin: " + CLOUD_DOMAIN});
+
+    ScopeGuard resetter = [&] { resetRequest(); };
+    syncSession(); // only cookies are needed, wait if they're being renewed
+    restClient->add<CURLOPT_HTTPHEADER>(getHeaders);
+
+    WriteData sink {&target, {}};
+    progress.flow = &sink.flow;
+    restClient->add<CURLOPT_WRITEDATA>(&sink);
     restClient->add<CURLOPT_WRITEFUNCTION>([](void *contents, size_t size, size_t nmemb, void *userp) {
-        auto result = static_cast<AbstractStorage *>(userp);
+        auto sink = static_cast<WriteData *>(userp);
         char *bytes = static_cast<char *>(contents);
         const size_t realsize = size * nmemb;
-        result->append(bytes, realsize);
+        BandwidthScheduler::getInstance().consume(BandwidthScheduler::Direction::DOWNLOAD, sink->flow, realsize);
+        sink->content->append(bytes, realsize);
         return realsize;
     });
 
+    auto &breaker = CircuitBreaker::getInstance();
+    if (!breaker.allow(endpoint))
+        throw CircuitOpenException(endpoint);
+
     try {
         restClient->perform();
     } catch (curl::curl_easy_exception &error) {
         curl::curlcpp_traceback errors = error.get_traceback();
         error.print_traceback();
-        throw MailApiException("Couldn't perform request!");
+        if (error.get_code() == CURLE_ABORTED_BY_CALLBACK && progress.stalled)
+            throw TransferStalledException(); // restarted by the caller, it records them if restarts don't help
+
+        breaker.record(endpoint, 0);
+        throw TransportException("Couldn't perform request!");
     }
     int64_t ret = restClient->get_info<CURLINFO_RESPONSE_CODE>().get();
-    if (ret != 302 && ret != 200) { // OK or redirect
+    breaker.record(endpoint, ret);
+    if (ret != 302 && ret != 200 && ret != 206) { // OK, redirect or partial content
         if (target.empty())
             throw MailApiException("Non-success return code!", ret);
 
         std::string body = target.readFully();
         throw MailApiException(std::string("Non-success return code! Body:") + body, ret);
     }
+    return ret;
 }
 
 bool MarcRestClient::login(const Account &acc) {
@@ -242,17 +544,151 @@ bool MarcRestClient::login(const Account &acc) {
 
     authAccount = acc;
 
+    AuthSession &session = authSession();
+    {
+        std::unique_lock<std::mutex> lock(session.mutex);
+        session.renewed.wait(lock, [&] { return !session.renewing; });
+        session.renewing = true;
+        session.renewer = this;
+    }
+    renewSession();
+    return true;
+}
+
+void MarcRestClient::reauthenticate() {
+    AuthSession &session = authSession();
+    {
+        std::unique_lock<std::mutex> lock(session.mutex);
+        if (session.renewing) {
+            // someone is on it already
+            session.renewed.wait(lock, [&] { return !session.renewing; });
+            return;
+        }
+
+        if (session.generation != sessionGeneration) {
+            // renewed after our request was made, just retry with the new one
+            return;
+        }
+
+        session.renewing = true;
+        session.renewer = this;
+    }
+
+    // expired cookies would prevent obtaining new ones
+    curl_easy_setopt(restClient->get_curl(), CURLOPT_COOKIELIST, "ALL");
+    renewSession();
+}
+
+void MarcRestClient::renewSession() {
+    AuthSession &session = authSession();
+    ScopeGuard finisher = [&] {
+        {
+            std::lock_guard<std::mutex> guard(session.mutex);
+            session.renewing = false;
+            session.renewer = nullptr;
+        }
+        session.renewed.notify_all();
+    };
+
     openMainPage();
     authenticate();
     openCloudPage();
 
-    return true;
+    std::lock_guard<std::mutex> guard(session.mutex);
+    session.generation++;
+    saveSession();
+}
+
+void MarcRestClient::setSessionFile(std::string path) {
+    AuthSession &session = authSession();
+    std::lock_guard<std::mutex> guard(session.mutex);
+    session.file = path;
+}
+
+void MarcRestClient::saveSession() {
+    AuthSession &session = authSession();
+    if (session.file.empty())
+        return;
+
+    Json::Value saved;
+    saved["login"] = authAccount.login;
+    saved["csrf"] = session.csrfToken;
+    saved["cookies"] = Json::Value(Json::arrayValue);
+    for (const std::string &cookie : cookieStore.get()) {
+        saved["cookies"].append(cookie);
+    }
+
+    Json::StreamWriterBuilder writer;
+    std::string content = Json::writeString(writer, saved);
+
+    // cookies are as good as password, nobody else should be able to read them.
+    // Write to temporary file first, so interrupted write doesn't spoil saved session.
+    // Its name is unique, concurrent saves of other mounts don't write into it
+    std::error_code error;
+    std::filesystem::path target(session.file);
+    std::filesystem::create_directories(target.parent_path(), error);
+
+    std::string temporary = session.file + ".XXXXXX";
+    int fd = ::mkstemp(temporary.data());
+    if (fd < 0) {
+        std::cerr << "Couldn't save session to " << session.file << ": " << strerror(errno) << std::endl;
+        return;
+    }
+
+    bool written = fchmod(fd, 0600) == 0 && ::write(fd, content.data(), content.size()) == static_cast<ssize_t>(content.size());
+    written = ::close(fd) == 0 && written;
+    if (!written || ::rename(temporary.data(), session.file.data()) != 0) {
+        std::cerr << "Couldn't save session to " << session.file << ": " << strerror(errno) << std::endl;
+        ::unlink(temporary.data());
+    }
+}
+
+bool MarcRestClient::resumeSession(const Account &acc) {
+    AuthSession &session = authSession();
+    std::string file;
+    {
+        std::lock_guard<std::mutex> guard(session.mutex);
+        file = session.file;
+    }
+
+    if (file.empty())
+        return false;
+
+    Json::Value saved;
+    Json::CharReaderBuilder reader;
+    std::ifstream sessionFile(file, std::ifstream::in | std::ifstream::binary);
+    std::string parseErrors;
+    if (sessionFile.fail() || !parseFromStream(reader, sessionFile, &saved, &parseErrors))
+        return false;
+
+    if (saved["login"].asString() != acc.login || saved["csrf"].asString().empty())
+        return false; // other account or broken file
+
+    authAccount = acc;
+    for (const Json::Value &cookie : saved["cookies"]) {
+        curl_easy_setopt(restClient->get_curl(), CURLOPT_COOKIELIST, cookie.asCString());
+    }
+    {
+        std::lock_guard<std::mutex> guard(session.mutex);
+        session.csrfToken = saved["csrf"].asString();
+        session.generation++;
+    }
+
+    try {
+        // cheapest call that requires valid session
+        df();
+        return true;
+    } catch (MailApiException &exc) {
+        std::cerr << "Saved session is not valid anymore, logging in: " << exc.what() << std::endl;
+        curl_easy_setopt(restClient->get_curl(), CURLOPT_COOKIELIST, "ALL");
+        return false;
+    }
 }
 
 void MarcRestClient::openMainPage() {
     size_t cookiesSize = cookieStore.get().size();
 
-    restClient->add<CURLOPT_URL>(MAIN_DOMAIN.data());
+    setUrl(MAIN_DOMAIN);
     performAction();
 
     auto savedCookies = cookieStore.get();
@@ -271,7 +707,7 @@ void MarcRestClient::openMainPage() {
 void MarcRestClient::openCloudPage() {
     size_t cookiesSize = cookieStore.get().size();
 
-    restClient->add<CURLOPT_URL>(CLOUD_DOMAIN.data());
+    setUrl(CLOUD_DOMAIN);
     std::string html = performAction();
 
     if (cookieStore.get().size() <= cookiesSize) // didn't get any new cookies
@@ -284,15 +720,23 @@ void MarcRestClient::openCloudPage() {
 
     size_t csrfQuoteStartPos = csrfTagStartPos + 8;
     size_t csrfQuoteEndPos = html.find("\"", csrfQuoteStartPos);
-    csrfToken = html.substr(csrfQuoteStartPos, csrfQuoteEndPos - csrfQuoteStartPos);
+
+    // others are waiting for renewal to finish, they won't see it before that
+    AuthSession &session = authSession();
+    std::lock_guard<std::mutex> guard(session.mutex);
+    session.csrfToken = html.substr(csrfQuoteStartPos, csrfQuoteEndPos - csrfQuoteStartPos);
 }
 
 void MarcRestClient::create(std::string remotePath) {
+    // add zero file, special hash
+    addByHash(remotePath, ZERO_HASH, 0);
+}
+
+void MarcRestClient::addByHash(std::string remotePath, std::string hash, size_t size) {
     std::string filename = remotePath.substr(remotePath.find_last_of("/\\") + 1);
     std::string parentDir = remotePath.substr(0, remotePath.find_last_of("/\\") + 1);
 
-    // add zero file, special hash
-    addUploadedFile(filename, parentDir, "0000000000000000000000000000000000000000", 0);
+    addUploadedFile(filename, parentDir, hash, size);
 }
 
 void MarcRestClient::authenticate() {
@@ -305,82 +749,186 @@ void MarcRestClient::authenticate() {
     form.add(NV_PAIR("saveauth", std::string("1")));
     form.add(NV_PAIR("token", actToken));
 
-    restClient->add<CURLOPT_URL>(AUTH_ENDPOINT.data());
+    setUrl(AUTH_ENDPOINT);
     restClient->add<CURLOPT_HTTPPOST>(form.get());
 
-    curl::curl_header force_main_domain;
-    force_main_domain.add("Accept: */*");
-    force_main_domain.add("Origin: " + MAIN_DOMAIN);
-    force_main_domain.add("Referer: " + MAIN_DOMAIN);
-
-    performAction(&force_main_domain);
+    static curl_slist *mainDomainHeaders = makeHeaders({"Accept: */*", "Origin: " + MAIN_DOMAIN, "Referer: " + MAIN_DOMAIN});
+    performAction(mainDomainHeaders);
 
     if (cookieStore.get().size() <= cookiesSize)  // no cookies received, halt
         throw MailApiException("Failed to authenticate with " + authAccount.login + " credentials");
 }
 
+/**
+ * @brief The ShardHosts struct - cached dispatcher answer for one shard type
+ */
+struct ShardHosts {
+    std::vector<Shard> hosts;
+    std::chrono::steady_clock::time_point since;
+};
+
+static std::mutex shardCacheMutex;
+static std::map<Shard::ShardType, ShardHosts> shardCache;
+
+/**
+ * @brief pickShard - choose one of advertised hosts, weighted by their count
+ * @param hosts - non-empty list of hosts
+ */
+static Shard pickShard(const std::vector<Shard> &hosts) {
+    size_t total = 0;
+    for (const Shard &host : hosts) {
+        total += std::max<size_t>(host.getCount(), 1);
+    }
+
+    thread_local std::mt19937 generator{std::random_device{}()};
+    size_t point = std::uniform_int_distribution<size_t>(0, total - 1)(generator);
+    for (const Shard &host : hosts) {
+        size_t weight = std::max<size_t>(host.getCount(), 1);
+        if (point < weight)
+            return host;
+
+        point -= weight;
+    }
+    return hosts.front();
+}
+
 Shard MarcRestClient::obtainShard(Shard::ShardType type) {
     using Json::Value;
 
-    restClient->add<CURLOPT_URL>(SCLD_SHARD_ENDPOINT.data());
+    {
+        std::lock_guard<std::mutex> guard(shardCacheMutex);
+        auto cached = shardCache.find(type);
+        if (cached != shardCache.end() && cached->second.since + SHARD_CACHE_TTL > std::chrono::steady_clock::now())
+            return pickShard(cached->second.hosts);
+    }
+
+    // not cached or expired, ask dispatcher
+    setUrl(SCLD_SHARD_ENDPOINT);
     std::string answer = performAction();
 
     Value response;
     std::istringstream(answer) >> response;
 
-    if (response["body"] != Value()) {
-        return Shard(response["body"][Shard::asString(type)]);
+    if (response["body"] == Value())
+        throw MailApiException("Non-Shard json received: " + answer);
+
+    // dispatcher returns all shard types at once, cache them all
+    std::lock_guard<std::mutex> guard(shardCacheMutex);
+    auto now = std::chrono::steady_clock::now();
+    for (int idx = static_cast<int>(Shard::ShardType::VIDEO); idx <= static_cast<int>(Shard::ShardType::THUMBNAILS); ++idx) {
+        auto shardType = static_cast<Shard::ShardType>(idx);
+        const Value &entries = response["body"][Shard::asString(shardType)];
+        if (!entries.isArray() || entries.empty())
+            continue;
+
+        ShardHosts cached;
+        cached.since = now;
+        for (const Value &entry : entries) {
+            cached.hosts.emplace_back(entry);
+        }
+        shardCache.erase(shardType);
+        shardCache.emplace(shardType, std::move(cached));
+    }
+
+    auto cached = shardCache.find(type);
+    if (cached == shardCache.end())
+        throw MailApiException("Non-Shard json received: " + answer);
+
+    return pickShard(cached->second.hosts);
+}
+
+void MarcRestClient::warmUp() {
+    // dispatcher call itself warms up connection to API host
+    std::vector<std::string> hosts;
+    for (auto type : {Shard::ShardType::GET, Shard::ShardType::UPLOAD}) {
+        try {
+            hosts.push_back(obtainShard(type).getUrl());
+        } catch (MailApiException &exc) {
+            std::cerr << "Couldn't obtain shard for warm-up: " << exc.what() << std::endl;
+        }
+    }
+
+    // headers-only requests to all shards at once. Connections stay in shared cache afterwards
+    std::vector<CURL *> probes;
+    std::vector<std::future<CURLcode>> results;
+    for (const std::string &host : hosts) {
+        CURL *handle = curl_easy_init();
+        curl_easy_setopt(handle, CURLOPT_URL, host.data());
+        curl_easy_setopt(handle, CURLOPT_NOBODY, 1L);
+        if (!this->proxyUrl.empty())
+            curl_easy_setopt(handle, CURLOPT_PROXY, this->proxyUrl.data());
+        curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT, 10L);
+        curl_easy_setopt(handle, CURLOPT_TCP_KEEPALIVE, 1L);
+        curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+        curl_easy_setopt(handle, CURLOPT_USERAGENT, SAFE_USER_AGENT.data());
+        curl_easy_setopt(handle, CURLOPT_SHARE, sharedState());
+        probes.push_back(handle);
+        results.push_back(TransferEngine::getInstance().submit(handle));
+    }
+
+    for (size_t i = 0; i < probes.size(); ++i) {
+        results[i].wait();
+        curl_easy_cleanup(probes[i]);
     }
+}
 
-    throw MailApiException("Non-Shard json received: " + answer);
+void MarcRestClient::forgetShard(Shard::ShardType type) {
+    // host may be down or not serving us anymore, ask dispatcher next time
+    std::lock_guard<std::mutex> guard(shardCacheMutex);
+    shardCache.erase(type);
 }
 
 void MarcRestClient::addUploadedFile(std::string name, std::string remoteDir, std::string hash, size_t size) {
-    std::string postFields = paramString({
+    setUrl(SCLD_ADDFILE_ENDPOINT);
+    setPostFields({
         {"hash", hash},
         {"size", std::to_string(size)},
         {"home", remoteDir + name},
         {"conflict", "rewrite"},  // also: rename, strict
         {"api", "2"}
     });
-
-    restClient->add<CURLOPT_URL>(SCLD_ADDFILE_ENDPOINT.data());
-    restClient->add<CURLOPT_POSTFIELDS>(postFields.data());
     performAction();
 }
 
 void MarcRestClient::move(std::string whatToMove, std::string whereToMove) {
-    std::string postFields = paramString({
+    setUrl(SCLD_MOVEFILE_ENDPOINT);
+    setPostFields({
         {"api", "2"},
         {"conflict", "rewrite"},  // also: rename, strict
         {"folder", whereToMove},
         {"home", whatToMove}
     });
-
-    restClient->add<CURLOPT_URL>(SCLD_MOVEFILE_ENDPOINT.data());
-    restClient->add<CURLOPT_POSTFIELDS>(postFields.data());
     performAction();
 }
 
 void MarcRestClient::remove(std::string remotePath) {
+    setUrl(SCLD_REMOVEFILE_ENDPOINT);
+    setPostFields({
+        {"api", "2"},
+        {"home", remotePath}
+    });
+    performAction();
+}
+
+std::future<void> MarcRestClient::removeAsync(std::string remotePath) {
     std::string postFields = paramString({
         {"api", "2"},
         {"home", remotePath}
     });
 
-    restClient->add<CURLOPT_URL>(SCLD_REMOVEFILE_ENDPOINT.data());
-    restClient->add<CURLOPT_POSTFIELDS>(postFields.data());
-    performAction();
+    auto answer = performAsync(SCLD_REMOVEFILE_ENDPOINT, postFields);
+    return std::async(std::launch::deferred, [answer = std::move(answer)]() mutable {
+        answer.get();
+    });
 }
 
 SpaceInfo MarcRestClient::df() {
     using Json::Value;
 
-    std::string getFields = paramString({
+    setUrl(SCLD_SPACE_ENDPOINT, {
         {"api", "2"}
     });
-
-    restClient->add<CURLOPT_URL>((SCLD_SPACE_ENDPOINT + "?" + getFields).data());
     std::string answer = performAction();
 
     SpaceInfo result;
@@ -406,15 +954,13 @@ void MarcRestClient::rename(std::string oldRemotePath, std::string newRemotePath
     std::string newFilename = newRemotePath.substr(newRemotePath.find_last_of("/\\") + 1);
     std::string newParentDir = newRemotePath.substr(0, newRemotePath.find_last_of("/\\") + 1);
 
-    std::string postFields = paramString({
+    setUrl(SCLD_RENAMEFILE_ENDPOINT);
+    setPostFields({
         {"api", "2"},
         {"conflict", "rewrite"}, // also: rename, strict
         {"home", oldRemotePath},
         {"name", newFilename}
     });
-
-    restClient->add<CURLOPT_URL>(SCLD_RENAMEFILE_ENDPOINT.data());
-    restClient->add<CURLOPT_POSTFIELDS>(postFields.data());
     performAction();
 
     // FIXME: think about version that doesn't rewrite file with name == newFilename
@@ -425,18 +971,12 @@ void MarcRestClient::rename(std::string oldRemotePath, std::string newRemotePath
     }
 }
 
-std::string MarcRestClient::share(std::string remotePath) {
+/**
+ * @brief parseShare - parse answer of publish call
+ */
+static std::string parseShare(const std::string &answer) {
     using Json::Value;
 
-    std::string postFields = paramString({
-        {"api", "2"},
-        {"home", remotePath}
-    });
-
-    restClient->add<CURLOPT_URL>(SCLD_PUBLISHFILE_ENDPOINT.data());
-    restClient->add<CURLOPT_POSTFIELDS>(postFields.data());
-    std::string answer = performAction();
-
     Value response;
     std::istringstream(answer) >> response;
 
@@ -446,81 +986,146 @@ std::string MarcRestClient::share(std::string remotePath) {
     return response["body"].asString();
 }
 
+std::string MarcRestClient::share(std::string remotePath) {
+    setUrl(SCLD_PUBLISHFILE_ENDPOINT);
+    setPostFields({
+        {"api", "2"},
+        {"home", remotePath}
+    });
+    return parseShare(performAction());
+}
+
+std::future<std::string> MarcRestClient::shareAsync(std::string remotePath) {
+    std::string postFields = paramString({
+        {"api", "2"},
+        {"home", remotePath}
+    });
+
+    auto answer = performAsync(SCLD_PUBLISHFILE_ENDPOINT, postFields);
+    return std::async(std::launch::deferred, [answer = std::move(answer)]() mutable {
+        return parseShare(answer.get());
+    });
+}
+
 struct ReadData {
     /*const*/ AbstractStorage * const content;  // content to read from
     off_t offset;  // current offset of read
     off_t count;   // maximum offset - can be lower than content.size()
+    BandwidthScheduler::Flow flow;  // share of upload rate limit
 };
 
 void MarcRestClient::upload(std::string remotePath, AbstractStorage &body, off_t start, off_t count) {
-    if (body.empty()) {
+    off_t realSize = std::max(std::min(static_cast<off_t>(body.size()) - start, count), off_t(0)); // size to transfer
+    std::string hash = uploadContent(body, start, count);
+    addByHash(remotePath, hash, realSize);
+}
+
+std::string MarcRestClient::uploadContent(AbstractStorage &body, off_t start, off_t count) {
+    off_t realSize = std::max(std::min(static_cast<off_t>(body.size()) - start, count), off_t(0)); // size to transfer
+    if (realSize == 0) {
         // zero size upload requested, skip upload part completely
-        create(remotePath);
-        return;
+        return ZERO_HASH;
     }
 
-    std::string filename = remotePath.substr(remotePath.find_last_of("/\\") + 1);
-    std::string parentDir = remotePath.substr(0, remotePath.find_last_of("/\\") + 1);
-
-    if (body.size() <= 20) {
+    if (realSize <= 20) {
         // Mail.ru Cloud has special handling for files that are no more than 20 bytes in size
-        std::string content = body.readFully();
-        addUploadedFile(filename, parentDir, toPadded40Hex(content), body.size());
-        return;
+        std::string content(realSize, '\0');
+        body.read(&content[0], realSize, start);
+        return toPadded40Hex(content);
     }
 
     Shard s = obtainShard(Shard::ShardType::UPLOAD);
-    std::string uploadUrl = s.getUrl() + "?" + paramString({{"cloud_domain", "2"}, {"x-email", authAccount.login}});
 
-    // fileupload part
-    curl_form nameForm;
-    off_t realSize = std::min(static_cast<off_t>(body.size()) - start, count);  // size to transfer
-    ReadData ptr {&body, start, std::min(static_cast<off_t>(body.size()), start + count)};
+    for (int restart = 0; ; ++restart) {
+        // fileupload part, from the beginning each time: upload can't be resumed
+        ReadData ptr {&body, start, start + realSize, {}};
+
+        setUrl(s.getUrl(), {{"cloud_domain", "2"}, {"x-email", authAccount.login}});
+        restClient->add<CURLOPT_UPLOAD>(1L);
+        //restClient->add<CURLOPT_INFILESIZE_LARGE>(realSize);
+        progress.flow = &ptr.flow;
+        restClient->add<CURLOPT_READDATA>(&ptr);
+        restClient->add<CURLOPT_READFUNCTION>([](void *contents, size_t size, size_t nmemb, void *userp) {
+            auto source = static_cast<ReadData *>(userp);
+            auto target = static_cast<char *>(contents);
+            const size_t requested = size * nmemb;
+            const size_t available = source->count - source->offset;
+            const size_t transferred = std::min(requested, available);
+            BandwidthScheduler::getInstance().consume(BandwidthScheduler::Direction::UPLOAD, source->flow, transferred);
+            source->content->read(target, transferred, source->offset);
+            source->offset += transferred;
+            return transferred;
+        });
+        if (restart)
+            restClient->add<CURLOPT_FRESH_CONNECT>(1L); // don't get the stalled one again
+
+        try {
+            return performAction(nullptr, false); // read callback may block, keep it off the engine
+        } catch (TransferStalledException &) {
+            if (restart < MAX_STALL_RESTARTS)
+                continue;
+            CircuitBreaker::getInstance().record(endpoint, 0);
+            forgetShard(Shard::ShardType::UPLOAD);
+            throw;
+        } catch (MailApiException &) {
+            forgetShard(Shard::ShardType::UPLOAD);
+            throw;
+        }
+    }
+}
 
-    restClient->add<CURLOPT_URL>(uploadUrl.data());
-    restClient->add<CURLOPT_UPLOAD>(1L);
-    //restClient->add<CURLOPT_INFILESIZE_LARGE>(realSize);
-    restClient->add<CURLOPT_READDATA>(&ptr);
-    restClient->add<CURLOPT_READFUNCTION>([](void *contents, size_t size, size_t nmemb, void *userp) {
-        auto source = static_cast<ReadData *>(userp);
-        auto target = static_cast<char *>(contents);
-        const size_t requested = size * nmemb;
-        const size_t available = source->count - source->offset;
-        const size_t transferred = std::min(requested, available);
-        source->content->read(target, transferred, source->offset);
-        source->offset += transferred;
+std::string MarcRestClient::uploadContent(std::function<ssize_t(char *, size_t)> source) {
+    Shard s = obtainShard(Shard::ShardType::UPLOAD);
+
+    // size is not known, this goes as chunked upload
+    BandwidthScheduler::Flow flow;
+    bool aborted = false;
+    std::function<ssize_t(char *, size_t)> throttled = [&](char *target, size_t requested) {
+        ssize_t transferred = source(target, requested);
+        if (transferred > 0)
+            BandwidthScheduler::getInstance().consume(BandwidthScheduler::Direction::UPLOAD, flow, transferred);
+        aborted = transferred < 0;
         return transferred;
+    };
+
+    setUrl(s.getUrl(), {{"cloud_domain", "2"}, {"x-email", authAccount.login}});
+    restClient->add<CURLOPT_UPLOAD>(1L);
+    progress.enabled = false; // source may pause as long as it wants, it's not a stall
+    restClient->add<CURLOPT_READDATA>(&throttled);
+    restClient->add<CURLOPT_READFUNCTION>([](void *contents, size_t size, size_t nmemb, void *userp) -> size_t {
+        auto source = static_cast<std::function<ssize_t(char *, size_t)> *>(userp);
+        ssize_t transferred = (*source)(static_cast<char *>(contents), size * nmemb);
+        if (transferred < 0)
+            return CURL_READFUNC_ABORT;
+
+        return static_cast<size_t>(transferred);
     });
-    std::string hash = performAction();
 
-    addUploadedFile(filename, parentDir, hash, realSize);
+    try {
+        return performAction(nullptr, false); // read callback may block, keep it off the engine
+    } catch (MailApiException &) {
+        if (!aborted) // source gave up, shard has nothing to do with it
+            forgetShard(Shard::ShardType::UPLOAD);
+        throw;
+    }
 }
 
 void MarcRestClient::mkdir(std::string remotePath) {
-    std::string postFields = paramString({
+    setUrl(SCLD_ADDFOLDER_ENDPOINT);
+    setPostFields({
         {"api", "2"},
         {"conflict", "rewrite"},  // also: rename, strict
         {"home", remotePath}
     });
-
-    restClient->add<CURLOPT_URL>(SCLD_ADDFOLDER_ENDPOINT.data());
-    restClient->add<CURLOPT_POSTFIELDS>(postFields.data());
     performAction();
 }
 
-std::vector<CloudFile> MarcRestClient::ls(std::string remotePath) {
+/**
+ * @brief parseLs - parse answer of folder listing call
+ */
+static std::vector<CloudFile> parseLs(const std::string &answer) {
     using Json::Value;
 
-    std::string getFields = paramString({
-        {"api", "2"},
-        {"offset", "0" }, // 100500 files in folder - who'd dare for more?
-        {"limit", "100500" }, // 100500 files in folder - who'd dare for more?
-        {"home", remotePath}
-    });
-
-    restClient->add<CURLOPT_URL>((SCLD_FOLDER_ENDPOINT + "?" + getFields).data());
-    std::string answer = performAction();
-
     std::vector<CloudFile> results;
     Value response;
     std::istringstream(answer) >> response;
@@ -536,9 +1141,65 @@ std::vector<CloudFile> MarcRestClient::ls(std::string remotePath) {
     return results;
 }
 
-void MarcRestClient::download(std::string remotePath, AbstractStorage &target) {
+std::vector<CloudFile> MarcRestClient::ls(std::string remotePath) {
+    setUrl(SCLD_FOLDER_ENDPOINT, {
+        {"api", "2"},
+        {"offset", "0" }, // 100500 files in folder - who'd dare for more?
+        {"limit", "100500" }, // 100500 files in folder - who'd dare for more?
+        {"home", remotePath}
+    });
+    return parseLs(performAction());
+}
+
+void MarcRestClient::download(std::string remotePath, AbstractStorage &target, off_t start, off_t count) {
+    if (count == 0)
+        return;
+
     Shard s = obtainShard(Shard::ShardType::GET);
     restClient->escape(remotePath);
-    restClient->add<CURLOPT_URL>((s.getUrl() + remotePath).data());
-    performGet(target);
+
+    off_t before = static_cast<off_t>(target.size());
+    for (int restart = 0; ; ++restart) {
+        setUrl(s.getUrl() + remotePath, {}, s.getUrl()); // one endpoint per shard host
+
+        // continue after bytes already received if restarted
+        off_t received = static_cast<off_t>(target.size()) - before;
+        std::string range;
+        if (start + received != 0 || count > 0) {
+            // partial download, e.g. "0-1023"
+            range = std::to_string(start + received) + "-" + (count < 0 ? "" : std::to_string(start + count - 1));
+            restClient->add<CURLOPT_RANGE>(range.data());
+        }
+        if (restart)
+            restClient->add<CURLOPT_FRESH_CONNECT>(1L); // don't get the stalled one again
+
+        off_t attemptStart = static_cast<off_t>(target.size());
+        try {
+            int64_t ret = performGet(target);
+            if (received > 0 && ret != 206) {
+                // server sent the whole file again instead of the rest
+                target.truncate(before);
+                throw MailApiException("Couldn't resume stalled download, range was ignored");
+            }
+            break;
+        } catch (TransferStalledException &) {
+            if (restart < MAX_STALL_RESTARTS)
+                continue;
+            CircuitBreaker::getInstance().record(endpoint, 0);
+            forgetShard(Shard::ShardType::GET);
+            throw;
+        } catch (MailApiException &exc) {
+            // bytes received before transport error are content, with response code it's error body
+            if (exc.getResponseCode() != 0)
+                target.truncate(attemptStart);
+            forgetShard(Shard::ShardType::GET);
+            throw;
+        }
+    }
+
+    if (count > 0 && static_cast<off_t>(target.size()) - before != count) {
+        // server ignored the range, don't leave wrong bytes there
+        target.truncate(before);
+        throw MailApiException("Range download returned unexpected amount of bytes");
+    }
 }
@@ -22,9 +22,12 @@
 #define API_H
 
 #include <memory>
+#include <future>
 #include <limits>
 #include <vector>
 #include <string>
+#include <string_view>
+#include <initializer_list>
 
 #include "account.h"
 #include "marc_api_shard.h"
@@ -33,6 +36,7 @@
 #include "curl_cookie.h"
 
 #include "utils.h"
+#include "bandwidth_scheduler.h"
 
 #define MARCFS_MAX_FILE_SIZE ((1L << 31) - (1L << 10)) // 2 GB except 1 KB for multipart boundaries etc.
 //#define MARCFS_MAX_FILE_SIZE (1L << 25) // 32 MiB - for tests
@@ -60,13 +64,14 @@ class AbstractStorage;
 class MarcRestClient
 {
 public:
-    using Params = std::map<std::string, std::string>;
+    using Params = std::initializer_list<std::pair<std::string_view, std::string_view>>;
 
     MarcRestClient();
 
     /**
      * @brief MarcRestClient - for copying already authenticated rest client.
-     *                         copies account and cookies from the argument
+     *                         copies account and tokens from the argument,
+     *                         cookies are shared between all clients
      * @param toCopy - readied client
      */
     MarcRestClient(MarcRestClient &toCopy);
@@ -78,16 +83,12 @@ public:
     void setProxy(std::string proxyUrl);
 
     /**
-     * @brief setMaxDownloadRate - set maximum download rate for this client, in bytes.
-     * @param rate - rate to set
+     * @brief setLowSpeedLimit - abort transfers that are slower than @param limit bytes
+     *        per second for @param time seconds. Time spent waiting for the share of rate limit
+     *        doesn't count. Aborted downloads are resumed on a fresh connection,
+     *        aborted uploads are restarted. Zero limit disables stall detection.
      */
-    void setMaxDownloadRate(uint64_t rate);
-
-    /**
-     * @brief setMaxUploadRate - set maximum upload rate for this client, in bytes.
-     * @param rate - rate to set
-     */
-    void setMaxUploadRate(uint64_t rate);
+    void setLowSpeedLimit(long limit, long time);
 
     /**
      * @brief API::login Sends auth info and initializes this API object on successful login.
@@ -96,12 +97,70 @@ public:
      */
     bool login(const Account& acc);
 
+    /**
+     * @brief reauthenticate - renew expired session shared by all clients. Does nothing
+     *        if session was already renewed after the last request of this client,
+     *        waits if other client is renewing it right now.
+     * @throws MailApiException in case of auth failure
+     */
+    void reauthenticate();
+
+    /**
+     * @brief setSessionFile - set file to keep session in between mounts. Session is saved
+     *        there each time it's renewed and can be resumed via @ref resumeSession.
+     * @param path - path to the file, empty string disables saving
+     */
+    static void setSessionFile(std::string path);
+
+    /**
+     * @brief resumeSession - restore session saved by previous mount and check it's still valid.
+     *        Takes one request instead of full login.
+     * @param acc - account session should belong to
+     * @return true if session was restored and is valid, false if full @ref login is needed
+     */
+    bool resumeSession(const Account &acc);
+
+    /**
+     * @brief warmUp - open connections to download and upload shards in advance,
+     *        so first transfers don't wait for TCP and TLS handshakes. Failures are ignored.
+     */
+    void warmUp();
+
     /**
      * @brief upload uploads bytes in @param body to remote endpoint
      * @param remotePath remote path to folder where uploaded file should be (e.g. /newfolder)
      */
     void upload(std::string remotePath, AbstractStorage &body, off_t start = 0, off_t count = std::numeric_limits<off_t>::max());
 
+    /**
+     * @brief uploadContent - uploads bytes in @param body to the upload shard without
+     *        adding them to the cloud tree. Result can be later linked to any path via @ref addByHash.
+     * @param body - storage to read content from
+     * @param start - offset in the storage to start reading from
+     * @param count - maximum count of bytes to upload
+     * @return hash of uploaded content as reported by the cloud
+     */
+    std::string uploadContent(AbstractStorage &body, off_t start = 0, off_t count = std::numeric_limits<off_t>::max());
+
+    /**
+     * @brief uploadContent - uploads bytes pulled from @param source to the upload shard
+     *        without adding them to the cloud tree. Used for streaming, when content
+     *        is not known in advance.
+     * @param source - functor filling the buffer passed to it. Must return count of bytes
+     *        written to the buffer, 0 when content is over or negative value to abort upload.
+     * @return hash of uploaded content as reported by the cloud
+     */
+    std::string uploadContent(std::function<ssize_t(char *, size_t)> source);
+
+    /**
+     * @brief addByHash - adds file with already known content hash to the cloud tree.
+     *        No data transfer happens, the content must be known to the cloud already.
+     * @param remotePath - full path of the file to be added
+     * @param hash - hash of content, as returned by @ref uploadContent
+     * @param size - size of content
+     */
+    void addByHash(std::string remotePath, std::string hash, size_t size);
+
     /**
      * @brief create - create empty file at path
      */
@@ -124,8 +183,10 @@ public:
      * @brief download download file pointed by remotePath to local path
      * @param remotePath remote path on cloud server
      * @param target target of download operation - resulting bytes are appended there
+     * @param start offset of the first byte to download
+     * @param count number of bytes to download, negative means up to the end of file
      */
-    void download(std::string remotePath, AbstractStorage &target);
+    void download(std::string remotePath, AbstractStorage &target, off_t start = 0, off_t count = -1);
 
     /**
      * @brief remove removes file pointed by remotePath from cloud storage
@@ -159,6 +220,21 @@ public:
      * @return url to shared file as a string
      */
     std::string share(std::string remotePath);
+
+    // asynchronous calls, performed by TransferEngine on transient handles with
+    // shared cookies and tokens of this client. Client may be released as soon as call returns.
+
+    /**
+     * @brief removeAsync - same as @ref remove, but doesn't block
+     * @return future that becomes ready once file is removed
+     */
+    std::future<void> removeAsync(std::string remotePath);
+
+    /**
+     * @brief shareAsync - same as @ref share, but doesn't block
+     * @return future that becomes ready with public link part
+     */
+    std::future<std::string> shareAsync(std::string remotePath);
  private:
     // api helpers
 
@@ -166,13 +242,21 @@ public:
 
     /**
      * @brief obtainShard obtains shard for next operation. It contains url to load-balanced
-     *        host to which request will be sent
+     *        host to which request will be sent. Dispatcher answer is cached for all clients,
+     *        hosts are chosen randomly, weighted by their count.
      * @param type type of shard to obtain
      * @return Shard of selected type
      * @throws MailApiException in case of non-success return code
      */
     Shard obtainShard(Shard::ShardType type);
 
+    /**
+     * @brief forgetShard drops cached dispatcher answer for this shard type,
+     *        called when transfer through it fails
+     * @param type type of shard to forget
+     */
+    static void forgetShard(Shard::ShardType type);
+
     // filesystem-related
 
     /**
@@ -196,6 +280,19 @@ public:
     void move(std::string whatToMove, std::string whereToMove);
 
     // auth
+
+    /**
+     * @brief renewSession - perform login steps and publish new session.
+     *        Caller must have marked session as being renewed by this client.
+     */
+    void renewSession();
+
+    /**
+     * @brief saveSession - save cookies and token of current session to session file, if any.
+     *        Caller must hold session lock.
+     */
+    void saveSession();
+
     /**
      * @brief API::authenticate - retrieves initial authentication cookies
      *
@@ -227,20 +324,122 @@ public:
     void obtainAuthToken();
 
     // cURL helpers
-    std::string paramString(Params const &params);
-    std::string performAction(curl::curl_header *forced_headers = nullptr);
-    void performGet(AbstractStorage &target);
+
+    /**
+     * @brief applyDefaults - set options that stay the same for all requests of this client.
+     *        They are kept on the handle between requests, see @ref resetRequest
+     */
+    void applyDefaults();
+
+    /**
+     * @brief resetRequest - undo options of the last request, keeping defaults and connections
+     */
+    void resetRequest();
+
+    /**
+     * @brief syncSession - wait for session renewal, if any, and update CSRF token
+     *        and @ref apiHeaders if it has changed since the last request.
+     *        Remembers which session request is made with.
+     */
+    void syncSession();
+
+    /**
+     * @brief checkProgress - curl progress callback, aborts request of the client
+     *        that stalled, see @ref StallDetector
+     */
+    static int checkProgress(void *clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow);
+
+    /**
+     * @brief setUrl - set URL of next request, built in @ref urlBuffer
+     * @param url - URL without query
+     * @param query - query parameters, appended escaped
+     * @param endpoint - endpoint this request counts against in circuit breaker,
+     *        URL without query by default
+     */
+    void setUrl(std::string_view url, Params query = {}, std::string_view endpoint = {});
+
+    /**
+     * @brief setPostFields - set body of next request to escaped @param params, built in @ref postBuffer
+     */
+    void setPostFields(Params params);
+
+    static void appendParams(std::string &target, Params params);
+    std::string paramString(Params params);
+    /**
+     * @brief performAction - perform request configured on @ref restClient and reset it afterwards
+     * @param forced_headers - headers to send instead of default ones
+     * @param multiplexed - perform via @ref TransferEngine, so concurrent requests of all clients
+     *        share a few HTTP/2 connections. Transfers with blocking callbacks must not use this.
+     * @return response body, valid until the next request of this client
+     * @throws MailApiException in case of failure or non-success return code
+     */
+    const std::string &performAction(curl_slist *forced_headers = nullptr, bool multiplexed = true);
+
+    /**
+     * @brief performAsync - perform API request on transient handle via @ref TransferEngine
+     * @param url - url to request
+     * @param postFields - body of POST request, GET is performed if empty
+     * @return future that becomes ready with response body
+     * @throws MailApiException from future in case of failure or non-success return code
+     */
+    std::future<std::string> performAsync(std::string url, std::string postFields = std::string());
+    /**
+     * @brief performGet - perform download configured on @ref restClient, appending to @param target
+     * @return response code, 200 or 206 for partial content
+     * @throws MailApiException in case of failure or non-success return code
+     */
+    int64_t performGet(AbstractStorage &target);
 
     std::unique_ptr<curl::curl_easy> restClient;
+
+    /**
+     * @brief endpoint - endpoint of current request, see @ref setUrl
+     */
+    std::string endpoint;
     curl::curl_cookie cookieStore;
 
+    // buffers reused by all requests of this client, they only grow
+    std::string urlBuffer;
+    std::string postBuffer;
+    std::string response;
+
+    /**
+     * @brief apiHeaders - headers of API requests, rebuilt only when @ref csrfToken changes
+     */
+    std::unique_ptr<curl_slist, decltype(&curl_slist_free_all)> apiHeaders {nullptr, curl_slist_free_all};
+    std::string csrfToken;
+
     std::string proxyUrl;
-    uint64_t maxUploadRate = 0;
-    uint64_t maxDownloadRate = 0;
+    long lowSpeedLimit = 1024;
+    long lowSpeedTime = 30;
+
+    /**
+     * @brief The StallDetector struct - progress of current request. Request is stalled if it
+     *        transfers less than @ref lowSpeedLimit bytes per second for @ref lowSpeedTime seconds,
+     *        not counting time its flow waits for the rate limit. curl's own low speed limit
+     *        can't be used for that, it counts the waits too.
+     */
+    struct StallDetector {
+        bool enabled = true;
+        const BandwidthScheduler::Flow *flow = nullptr; // flow of the transfer, if it's rate limited
+        std::chrono::steady_clock::time_point since;    // start of current window
+        std::chrono::steady_clock::duration waited {};  // waits of the flow before the window
+        curl_off_t transferred = 0;                     // bytes transferred before the window
+        bool stalled = false;                           // request was aborted as stalled
+    };
+
+    /**
+     * @brief progress - stall detection of current request, cleared by @ref resetRequest
+     */
+    StallDetector progress;
 
     Account authAccount;
     std::string actToken;
-    std::string csrfToken;
+
+    /**
+     * @brief sessionGeneration - generation of shared session the last request was made with
+     */
+    uint64_t sessionGeneration = 0;
 
     int64_t verbose = 0;
 };
@@ -31,14 +31,19 @@ void MemoryStorage::open() {
 }
 
 bool MemoryStorage::empty() /*const*/ {
+    std::lock_guard<std::mutex> guard(rw_mutex);
     return data.empty();
 }
 
 size_t MemoryStorage::size() /*const*/ {
+    std::lock_guard<std::mutex> guard(rw_mutex);
     return data.size();
 }
 
 int MemoryStorage::read(char *buf, size_t size, uint64_t offset) {
+    // background uploads may read while writer resizes the vector
+    std::lock_guard<std::mutex> guard(rw_mutex);
+
     auto len = data.size();
     if (offset > len)
         return 0; // requested bytes above the size
@@ -55,6 +60,8 @@ int MemoryStorage::read(char *buf, size_t size, uint64_t offset) {
 }
 
 int MemoryStorage::write(const char *buf, size_t size, uint64_t offset) {
+    std::lock_guard<std::mutex> guard(rw_mutex);
+
     if (offset + size > data.size()) {
         data.resize(offset + size);
     }
@@ -64,19 +71,23 @@ int MemoryStorage::write(const char *buf, size_t size, uint64_t offset) {
 }
 
 void MemoryStorage::append(const char *buf, size_t size) {
+    std::lock_guard<std::mutex> guard(rw_mutex);
     std::vector<char> tail(buf, buf + size);
     data.insert(data.end(), tail.begin(), tail.end());
 }
 
 std::string MemoryStorage::readFully() {
+    std::lock_guard<std::mutex> guard(rw_mutex);
     return std::string(&data.front(), data.size());
 }
 
 void MemoryStorage::clear() {
+    std::lock_guard<std::mutex> guard(rw_mutex);
     data.clear();
     data.shrink_to_fit();
 }
 
 void MemoryStorage::truncate(off_t size) {
+    std::lock_guard<std::mutex> guard(rw_mutex);
     data.resize(static_cast<uint64_t>(size));
 }
@@ -22,6 +22,7 @@
 #define MEMORY_STORAGE_H
 
 #include <vector>
+#include <mutex>
 
 #include "abstract_storage.h"
 
@@ -48,6 +49,7 @@ public:
     virtual void truncate(off_t size) override;
 
 private:
+    std::mutex rw_mutex;
     std::vector<char> data;
 };
 
@@ -34,7 +34,7 @@ std::shared_ptr<CacheNode> CacheManager::get(const std::string &path) {
     }
 
     auto now = std::chrono::steady_clock::now();
-    if (cached->second->cached_since + this->cacheTtl < now) {
+    if (!cached->second->pinned && cached->second->cached_since + this->cacheTtl < now) {
         // cache expired, invalidate
         guard.unlock();
         UniqueLock writeGuard(cacheLock);
@@ -58,6 +58,32 @@ void CacheManager::remove(const std::string &path) {
     statCache.erase(path);
 }
 
+void CacheManager::unpin(const std::string &path) {
+    UniqueLock guard(cacheLock);
+
+    auto cached = statCache.find(path);
+    if (cached == statCache.end() || !cached->second->pinned) {
+        return;
+    }
+
+    cached->second->pinned = false;
+    cached->second->cached_since = std::chrono::steady_clock::now();
+}
+
+void CacheManager::setHash(const std::string &path, const std::string &hash) {
+    UniqueLock guard(cacheLock);
+
+    auto cached = statCache.find(path);
+    if (cached == statCache.end()) {
+        return;
+    }
+
+    // entry may be in use by readers, replace it with an updated copy
+    auto updated = std::make_shared<CacheNode>(*cached->second);
+    updated->hash = hash;
+    cached->second = updated;
+}
+
 void CacheManager::update(const std::string &path, MarcNode &node) {
     UniqueLock guard(cacheLock);
 
@@ -67,6 +93,7 @@ void CacheManager::update(const std::string &path, MarcNode &node) {
     }
 
     node.fillStat(&cached->second->stbuf);
+    cached->second->hash.clear(); // content may have changed
 }
 
 void fillStat(struct stat *stbuf, const CloudFile *cf) {
@@ -40,8 +40,9 @@ using namespace std::chrono_literals;
 
 struct CacheNode {
 
-    explicit CacheNode(const struct stat &stbuf)
+    explicit CacheNode(const struct stat &stbuf, std::string hash = std::string())
     : stbuf(stbuf),
+      hash(hash),
       cached_since(std::chrono::steady_clock::now()) {
     }
 
@@ -51,6 +52,18 @@ struct CacheNode {
      */
     struct stat stbuf = {};
 
+    /**
+     * @brief hash - content hash as reported by the cloud, part hashes joined
+     *        with ',' for compound files. Empty if unknown, e.g. after local changes.
+     */
+    std::string hash;
+
+    /**
+     * @brief pinned - entry doesn't expire, used for files that exist only locally
+     *        and can't be found in the cloud. See @ref CacheManager::unpin
+     */
+    bool pinned = false;
+
  private:
     /**
      * @brief cached_since - marks time when this node was created
@@ -87,6 +100,16 @@ class CacheManager {
      * 
      */
     void update(const std::string &path, MarcNode &node);
+
+    /**
+     * @brief setHash - set content hash of cached entry, keeping the rest of it intact
+     */
+    void setHash(const std::string &path, const std::string &hash);
+
+    /**
+     * @brief unpin - let pinned entry expire as usual, starting from now
+     */
+    void unpin(const std::string &path);
     void remove(const std::string &path);
  private:
     std::shared_timed_mutex cacheLock;
@@ -21,80 +21,271 @@
 #ifndef OBJECT_POOL_H
 #define OBJECT_POOL_H
 
-#include <list>
-#include <stack>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
 #include <mutex>
 #include <condition_variable>
 
 #include <iostream>
 
 /**
- * Shared-pointer based object pool that readds objects that are no longer used.
- * Thread-safe (I hope).
+ * Elastic object pool with lock-free free list.
+ *
+ * Pool has fixed count of slots, each holding one object or none. Objects are created lazily
+ * as copies of a prototype when all existing ones are taken, and destroyed again when they
+ * stay unused for too long, down to minimal count. Free slots form a Treiber stack of indices
+ * tagged with a counter against ABA, so acquiring and returning objects doesn't lock or allocate.
+ * Mutexes are only taken when caller has to wait for an object to be returned or
+ * a new object has to be copied from the prototype.
  */
 template<typename T>
 class ObjectPool
 {
 public:
-    ~ObjectPool() {
-        shuttingDown = true;
-    }
+    /**
+     * @brief The Handle class - object taken from the pool, returns it on destruction
+     */
+    class Handle {
+    public:
+        Handle() = default;
+        Handle(const Handle&) = delete;
+        Handle& operator=(const Handle&) = delete;
 
-    void populate(T& obj, size_t number) {
-        for (size_t i = 0; i < number; ++i) {
-            objects.emplace_back(std::shared_ptr<T>(new T(obj), ExternalDeleter(this)));
+        Handle(Handle &&other) noexcept
+        : pool(other.pool),
+          slot(other.slot) {
+            other.pool = nullptr;
         }
-    }
 
-    template<typename F, typename ...Args>
-    void initialize(F&& functor, Args... args) {
-        for (int i = 0; i < objects.size(); ++i) {
-            auto obj = acquire();
-            (obj.get()->*functor)(args...);
+        Handle& operator=(Handle &&other) noexcept {
+            if (this != &other) {
+                reset();
+                pool = other.pool;
+                slot = other.slot;
+                other.pool = nullptr;
+            }
+            return *this;
         }
-    }
 
-    std::shared_ptr<T> acquire() {
-        {
-            std::unique_lock<std::mutex> lock(acquire_mutex);
-            condition.wait(lock, [this]{ return !objects.empty(); });
-            auto tmp = std::move(objects.front());
-            objects.pop_front();
-            return tmp;
+        ~Handle() {
+            reset();
+        }
+
+        T* get() const {
+            return pool->slots[slot].object.get();
+        }
+
+        T* operator->() const {
+            return get();
+        }
+
+        explicit operator bool() const {
+            return pool != nullptr;
+        }
+
+        /**
+         * @brief reset - return object to the pool right away
+         */
+        void reset() {
+            if (pool)
+                pool->release(slot);
+            pool = nullptr;
+        }
+
+    private:
+        friend class ObjectPool<T>;
+
+        Handle(ObjectPool<T> *pool, uint32_t slot)
+        : pool(pool),
+          slot(slot) {
         }
+
+        ObjectPool<T> *pool = nullptr;
+        uint32_t slot = 0;
+    };
+
+    /**
+     * @brief populate - prepare pool for use, must be called once before any @ref acquire
+     * @param prototype - object to copy new ones from
+     * @param minSize - count of objects created right away and never destroyed
+     * @param maxSize - maximum count of objects
+     * @param idleTimeout - objects unused for this long are destroyed
+     */
+    void populate(T& prototype, size_t minSize, size_t maxSize,
+                  std::chrono::steady_clock::duration idleTimeout = std::chrono::seconds(60)) {
+        this->prototype = std::make_unique<T>(prototype);
+        this->minSize = minSize;
+        this->idleTimeout = idleTimeout;
+
+        slots = std::make_unique<Slot[]>(maxSize);
+        for (size_t i = 0; i < maxSize; ++i) {
+            if (i < minSize) {
+                slots[i].object = std::make_unique<T>(*this->prototype);
+                created++;
+            }
+            slots[i].next.store(i + 1 < maxSize ? i + 2 : 0, std::memory_order_relaxed);
+        }
+        head.store(maxSize ? 1 : 0);
+        available.store(maxSize);
+        lastShrink.store(now());
+        wakeWaiters();
     }
 
-    void add(std::shared_ptr<T> obj) {
-        {
-            std::unique_lock<std::mutex> lock(acquire_mutex);
-            objects.emplace_back(std::move(obj));
+    /**
+     * @brief acquire - take an object from the pool, waiting until one is available
+     * @param reserve - count of objects that must stay in the pool for other callers,
+     *        low-priority callers pass non-zero value here so they can't exhaust the pool
+     */
+    Handle acquire(size_t reserve = 0) {
+        // claim one of free slots, it's guaranteed to be in the stack afterwards
+        ptrdiff_t free = available.load();
+        while (true) {
+            if (free > static_cast<ptrdiff_t>(reserve)) {
+                if (available.compare_exchange_weak(free, free - 1))
+                    break;
+                continue;
+            }
+
+            // nothing for us, wait for objects to be returned
+            std::unique_lock<std::mutex> lock(waitMutex);
+            waiters++;
+            condition.wait(lock, [this, reserve]{ return available.load() > static_cast<ptrdiff_t>(reserve); });
+            waiters--;
+            free = available.load();
+        }
+
+        uint32_t idx = pop();
+        Slot &slot = slots[idx];
+        if (!slot.object) {
+            try {
+                // copying may touch shared state of the prototype, e.g. curl_easy_duphandle
+                std::lock_guard<std::mutex> guard(prototypeMutex);
+                slot.object = std::make_unique<T>(*prototype);
+                created++;
+            } catch (...) {
+                release(idx);
+                throw;
+            }
         }
-        condition.notify_one();
+        return Handle(this, idx);
     }
 
 private:
-    // deleter that returns objects to the pool
-    struct ExternalDeleter {
-        explicit ExternalDeleter(ObjectPool<T>* pool)
-        : pool(pool) {}
+    struct Slot {
+        std::unique_ptr<T> object;
+        std::atomic<uint32_t> next = {0};     // index + 1 of next free slot, 0 if it's the last
+        std::atomic<int64_t> lastUsed = {0};  // ticks of steady clock when object was returned
+    };
+
+    static int64_t now() {
+        return std::chrono::steady_clock::now().time_since_epoch().count();
+    }
+
+    /**
+     * @brief push - put slot on top of free stack
+     */
+    void push(uint32_t idx) {
+        uint64_t top = head.load(std::memory_order_relaxed);
+        do {
+            slots[idx].next.store(static_cast<uint32_t>(top), std::memory_order_relaxed);
+        } while (!head.compare_exchange_weak(top, nextTag(top) | (idx + 1), std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    /**
+     * @brief pop - take slot from top of free stack. Caller must have claimed it in @ref available
+     */
+    uint32_t pop() {
+        uint64_t top = head.load(std::memory_order_acquire);
+        while (true) {
+            uint32_t idx = static_cast<uint32_t>(top);
+            if (!idx) {
+                // claimed slot is still being pushed
+                std::this_thread::yield();
+                top = head.load(std::memory_order_acquire);
+                continue;
+            }
+
+            uint32_t next = slots[idx - 1].next.load(std::memory_order_relaxed);
+            if (head.compare_exchange_weak(top, nextTag(top) | next, std::memory_order_acquire, std::memory_order_acquire))
+                return idx - 1;
+        }
+    }
+
+    static uint64_t nextTag(uint64_t top) {
+        return ((top >> 32) + 1) << 32;
+    }
+
+    void release(uint32_t idx) {
+        slots[idx].lastUsed.store(now(), std::memory_order_relaxed);
+        push(idx);
+        available++;
+        wakeWaiters();
+
+        int64_t shrunk = lastShrink.load(std::memory_order_relaxed);
+        if (now() - shrunk > idleTimeout.count() && lastShrink.compare_exchange_strong(shrunk, now()))
+            shrink();
+    }
+
+    void wakeWaiters() {
+        if (waiters.load() == 0)
+            return;
 
-        void operator()(T* ptr) {
-            if (pool->shuttingDown)
-                return;
+        // lock to not slip between predicate check and wait of the waiter
+        std::lock_guard<std::mutex> guard(waitMutex);
+        condition.notify_all();
+    }
 
-            pool->add(std::shared_ptr<T>(ptr, *this));
+    /**
+     * @brief shrink - destroy objects that were idle for too long, keeping at least @ref minSize
+     */
+    void shrink() {
+        // take all free slots out to inspect them, waiters will wait for a moment
+        ptrdiff_t taken = available.load();
+        while (taken > 0 && !available.compare_exchange_weak(taken, 0)) {
+        }
+        if (taken <= 0)
             return;
+
+        // stack is LIFO, so popped ones go from most to least recently used
+        std::vector<uint32_t> idle;
+        for (ptrdiff_t i = 0; i < taken; ++i) {
+            idle.push_back(pop());
         }
 
-    private:
-        ObjectPool<T>* pool;
-    };
+        int64_t threshold = now() - idleTimeout.count();
+        for (uint32_t idx : idle) {
+            Slot &slot = slots[idx];
+            if (slot.object && slot.lastUsed.load(std::memory_order_relaxed) < threshold && created > minSize) {
+                slot.object.reset();
+                created--;
+            }
+        }
 
-    std::condition_variable condition;
-    std::mutex acquire_mutex;
+        // push back in reverse, so recently used objects stay on top
+        for (auto it = idle.rbegin(); it != idle.rend(); ++it) {
+            push(*it);
+        }
+        available += taken;
+        wakeWaiters();
+    }
 
-    bool shuttingDown = false;
-    std::list<std::shared_ptr<T>> objects;
+    std::unique_ptr<T> prototype;
+    std::mutex prototypeMutex;              // guards copying of the prototype
+    std::unique_ptr<Slot[]> slots;
+    size_t minSize = 0;
+    std::chrono::steady_clock::duration idleTimeout;
+
+    std::atomic<uint64_t> head = {0};       // tag in upper half, index + 1 of top slot in lower, 0 if empty
+    std::atomic<ptrdiff_t> available = {0}; // count of free slots not claimed by anyone
+    std::atomic<size_t> created = {0};      // count of slots holding an object
+    std::atomic<int64_t> lastShrink = {0};
+
+    std::mutex waitMutex;
+    std::condition_variable condition;
+    std::atomic<size_t> waiters = {0};
 };
 
 #endif // OBJECT_POOL_H
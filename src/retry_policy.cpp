@@ -0,0 +1,105 @@
+/*****************************************************************************
+ *
+ * Copyright (c) 2018-2020, Oleg `Kanedias` Chernovskiy
+ *
+ * This file is part of MARC-FS.
+ *
+ * MARC-FS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MARC-FS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MARC-FS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <random>
+#include <algorithm>
+
+#include "retry_policy.h"
+
+/**
+ * @brief FAILURE_THRESHOLD - consecutive transient failures that open the circuit
+ */
+static const uint FAILURE_THRESHOLD = 5;
+
+bool isTransient(int64_t responseCode) {
+    return responseCode == 429 || responseCode >= 500;
+}
+
+bool isTransient(const MailApiException &exc) {
+    return dynamic_cast<const TransportException *>(&exc) || isTransient(exc.getResponseCode());
+}
+
+bool isAuthFailure(int64_t responseCode) {
+    return responseCode == 401 || responseCode == 403;
+}
+
+bool RetryPolicy::shouldRetry(const MailApiException &exc, uint attempt, bool idempotent) const {
+    if (attempt >= maxRetries)
+        return false;
+
+    if (!idempotent) {
+        // request may have been applied already, only throttled one was surely not
+        return exc.getResponseCode() == 429;
+    }
+    return isTransient(exc);
+}
+
+std::chrono::milliseconds RetryPolicy::backoff(uint attempt) const {
+    // base * 2^attempt, without overflowing on large attempt numbers
+    auto ceiling = baseDelay;
+    for (uint i = 0; i < attempt && ceiling < maxDelay; ++i) {
+        ceiling *= 2;
+    }
+    ceiling = std::min(ceiling, maxDelay);
+
+    thread_local std::mt19937 generator{std::random_device{}()};
+    std::uniform_int_distribution<int64_t> jitter(0, ceiling.count());
+    return std::chrono::milliseconds(jitter(generator));
+}
+
+CircuitBreaker::CircuitBreaker(std::chrono::steady_clock::duration cooldown)
+    : cooldown(cooldown) {
+}
+
+CircuitBreaker &CircuitBreaker::getInstance() {
+    static CircuitBreaker instance;
+    return instance;
+}
+
+bool CircuitBreaker::allow(const std::string &endpoint) {
+    std::lock_guard<std::mutex> guard(stateMutex);
+    auto it = states.find(endpoint);
+    if (it == states.end() || it->second.failures < FAILURE_THRESHOLD)
+        return true; // closed, all is fine
+
+    EndpointState &state = it->second;
+    if (std::chrono::steady_clock::now() < state.openUntil || state.probing)
+        return false; // open, or someone is already probing
+
+    // cooldown passed, let one call check whether endpoint is back
+    state.probing = true;
+    return true;
+}
+
+void CircuitBreaker::record(const std::string &endpoint, int64_t responseCode) {
+    std::lock_guard<std::mutex> guard(stateMutex);
+    if (responseCode != 0 && !isTransient(responseCode)) {
+        // endpoint answers, even if with an error
+        states.erase(endpoint);
+        return;
+    }
+
+    EndpointState &state = states[endpoint];
+    state.failures++;
+    state.probing = false;
+    if (state.failures >= FAILURE_THRESHOLD) {
+        state.openUntil = std::chrono::steady_clock::now() + cooldown;
+    }
+}
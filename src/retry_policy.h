@@ -0,0 +1,169 @@
+/*****************************************************************************
+ *
+ * Copyright (c) 2018-2020, Oleg `Kanedias` Chernovskiy
+ *
+ * This file is part of MARC-FS.
+ *
+ * MARC-FS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MARC-FS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MARC-FS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RETRY_POLICY_H
+#define RETRY_POLICY_H
+
+#include <chrono>
+#include <string>
+#include <mutex>
+#include <map>
+
+#include "utils.h"
+
+using namespace std::chrono_literals;
+
+/**
+ * @brief The TransportException struct - request got no response: connection failed,
+ *        was reset or timed out. Request may or may not have been applied by the server.
+ */
+struct TransportException : public MailApiException {
+    explicit TransportException(std::string reason)
+        : MailApiException(reason)
+    {
+    }
+};
+
+/**
+ * @brief isTransient - check whether server response with this code may go away by itself:
+ *        throttling (429) and server errors (5xx)
+ * @param responseCode - HTTP response code
+ */
+bool isTransient(int64_t responseCode);
+
+/**
+ * @brief isTransient - check whether failure may go away by itself: transport errors,
+ *        throttling and server errors. Errors in parsing of answers and other
+ *        failures without response code are not.
+ */
+bool isTransient(const MailApiException &exc);
+
+/**
+ * @brief isAuthFailure - check whether call failed because session has expired
+ * @param responseCode - HTTP response code, 0 if there was no response
+ */
+bool isAuthFailure(int64_t responseCode);
+
+/**
+ * @brief The RetryPolicy struct - how failed cloud calls are retried.
+ *
+ * Delays grow exponentially and are randomized ("full jitter"), so clients that failed
+ * together don't retry together and don't hammer recovering servers.
+ */
+struct RetryPolicy
+{
+    /**
+     * @brief maxRetries - retries after first attempt, 0 disables retrying
+     */
+    uint maxRetries = 3;
+
+    /**
+     * @brief baseDelay - upper bound of delay before first retry, doubles with each next one
+     */
+    std::chrono::milliseconds baseDelay = 200ms;
+
+    /**
+     * @brief maxDelay - upper bound of delay before any retry
+     */
+    std::chrono::milliseconds maxDelay = 10s;
+
+    /**
+     * @brief shouldRetry - check whether call should be retried
+     * @param exc - failure of the attempt
+     * @param attempt - number of failed attempt, starting from 0
+     * @param idempotent - whether repeating the call is harmless. Calls that are not
+     *        are only retried if server surely refused them
+     */
+    bool shouldRetry(const MailApiException &exc, uint attempt, bool idempotent = true) const;
+
+    /**
+     * @brief backoff - obtain randomized delay before next attempt
+     * @param attempt - number of failed attempt, starting from 0
+     */
+    std::chrono::milliseconds backoff(uint attempt) const;
+};
+
+/**
+ * @brief The CircuitOpenException struct - call was not made as endpoint keeps failing.
+ *        Not retried, retrying is what circuit breaker prevents.
+ */
+struct CircuitOpenException : public MailApiException {
+    explicit CircuitOpenException(std::string endpoint)
+        : MailApiException("Endpoint keeps failing, not calling it for now: " + endpoint)
+    {
+    }
+};
+
+/**
+ * @brief The TransferStalledException struct - transfer was aborted as it was slower than
+ *        low speed limit for too long. Connection is likely dead, restart it on a fresh one.
+ */
+struct TransferStalledException : public TransportException {
+    TransferStalledException()
+        : TransportException("Transfer stalled, aborted")
+    {
+    }
+};
+
+/**
+ * @brief The CircuitBreaker class - stops calling endpoints that keep failing.
+ *
+ * After several consecutive transient failures endpoint is considered down ("open")
+ * and calls to it fail immediately for a cooldown period. After that a single probe call
+ * is let through, its success brings the endpoint back, failure opens it again.
+ */
+class CircuitBreaker
+{
+public:
+    /**
+     * @brief CircuitBreaker - create breaker, cloud calls use the shared one from @ref getInstance
+     * @param cooldown - how long calls to failing endpoint are not made
+     */
+    explicit CircuitBreaker(std::chrono::steady_clock::duration cooldown = 30s);
+
+    static CircuitBreaker & getInstance();
+
+    /**
+     * @brief allow - check whether call to endpoint may be made now
+     * @param endpoint - URL of endpoint without query
+     */
+    bool allow(const std::string &endpoint);
+
+    /**
+     * @brief record - account outcome of the call made to endpoint
+     * @param endpoint - URL of endpoint without query
+     * @param responseCode - HTTP response code, 0 if there was no response (transport error)
+     */
+    void record(const std::string &endpoint, int64_t responseCode);
+
+private:
+    const std::chrono::steady_clock::duration cooldown;
+
+    struct EndpointState {
+        uint failures = 0;
+        std::chrono::steady_clock::time_point openUntil;
+        bool probing = false;
+    };
+
+    std::mutex stateMutex;
+    std::map<std::string, EndpointState> states;
+};
+
+#endif // RETRY_POLICY_H
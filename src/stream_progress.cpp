@@ -0,0 +1,61 @@
+/*****************************************************************************
+ *
+ * Copyright (c) 2018-2020, Oleg `Kanedias` Chernovskiy
+ *
+ * This file is part of MARC-FS.
+ *
+ * MARC-FS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MARC-FS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MARC-FS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+
+#include "stream_progress.h"
+
+void StreamProgress::advance(off_t end) {
+    {
+        std::lock_guard<std::mutex> lock(progressMutex);
+        this->end = std::max(this->end, end);
+    }
+    advanced.notify_all();
+}
+
+off_t StreamProgress::waitBeyond(off_t offset) {
+    std::unique_lock<std::mutex> lock(progressMutex);
+    advanced.wait(lock, [&] { return aborted || closed || end > offset; });
+    if (aborted)
+        return -1;
+
+    return std::max(end, offset);
+}
+
+void StreamProgress::close() {
+    {
+        std::lock_guard<std::mutex> lock(progressMutex);
+        closed = true;
+    }
+    advanced.notify_all();
+}
+
+void StreamProgress::abort() {
+    {
+        std::lock_guard<std::mutex> lock(progressMutex);
+        aborted = true;
+    }
+    advanced.notify_all();
+}
+
+bool StreamProgress::isAborted() {
+    std::lock_guard<std::mutex> lock(progressMutex);
+    return aborted;
+}
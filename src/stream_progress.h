@@ -0,0 +1,75 @@
+/*****************************************************************************
+ *
+ * Copyright (c) 2018-2020, Oleg `Kanedias` Chernovskiy
+ *
+ * This file is part of MARC-FS.
+ *
+ * MARC-FS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MARC-FS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MARC-FS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAM_PROGRESS_H
+#define STREAM_PROGRESS_H
+
+#include <sys/types.h>
+
+#include <mutex>
+#include <condition_variable>
+
+/**
+ * @brief The StreamProgress class - how far a sequential writer has got,
+ *        for a reader in another thread that follows it.
+ *
+ * Bytes themselves are kept elsewhere, e.g. in staged content of a file,
+ * writer only announces them. Writer never waits, reader waits for new bytes.
+ *
+ * @see MarcFileNode
+ */
+class StreamProgress
+{
+public:
+    /**
+     * @brief advance - announce that bytes up to @param end are written
+     */
+    void advance(off_t end);
+
+    /**
+     * @brief waitBeyond - wait until there are bytes after @param offset
+     * @return end of written bytes, @param offset itself if stream is closed
+     *         and there's nothing more, -1 if stream is aborted
+     */
+    off_t waitBeyond(off_t offset);
+
+    /**
+     * @brief close - indicate that no more bytes will be written.
+     *        Reader can still take what's announced.
+     */
+    void close();
+
+    /**
+     * @brief abort - drop the stream, wake up the reader
+     */
+    void abort();
+
+    bool isAborted();
+
+private:
+    off_t end = 0;
+    bool closed = false;
+    bool aborted = false;
+
+    std::mutex progressMutex;
+    std::condition_variable advanced;
+};
+
+#endif // STREAM_PROGRESS_H
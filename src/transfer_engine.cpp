@@ -0,0 +1,140 @@
+/*****************************************************************************
+ *
+ * Copyright (c) 2018-2020, Oleg `Kanedias` Chernovskiy
+ *
+ * This file is part of MARC-FS.
+ *
+ * MARC-FS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MARC-FS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MARC-FS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "transfer_engine.h"
+
+/**
+ * @brief MAX_HOST_CONNECTIONS - connections per host, requests above that wait.
+ *        Not lower than maximum size of client pool (see main.cpp), so without HTTP/2,
+ *        e.g. through a proxy, each pooled client still gets its own connection.
+ *        With HTTP/2 requests wait for existing connections (CURLOPT_PIPEWAIT)
+ *        and are multiplexed over them, so the cap is not reached.
+ */
+static const long MAX_HOST_CONNECTIONS = 32;
+
+TransferEngine &TransferEngine::getInstance() {
+    static TransferEngine instance;
+    return instance;
+}
+
+TransferEngine::TransferEngine()
+    : multi(curl_multi_init()) {
+    // concurrent requests to the same host go as HTTP/2 streams over few connections
+    curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, MAX_HOST_CONNECTIONS);
+}
+
+TransferEngine::~TransferEngine() {
+    stopped = true;
+    curl_multi_wakeup(multi);
+    if (worker && workerPid == getpid())
+        worker->join();
+    else
+        worker.release(); // thread of parent process, see ensureWorker
+
+    curl_multi_cleanup(multi);
+}
+
+void TransferEngine::ensureWorker() {
+    if (worker && workerPid == getpid())
+        return;
+
+    if (worker) {
+        // forked after the loop was started, e.g. by daemonizing FUSE.
+        // Thread exists in parent only, its object can be neither joined nor destroyed here
+        worker.release();
+    }
+    workerPid = getpid();
+    worker = std::make_unique<std::thread>(&TransferEngine::loop, this);
+}
+
+void TransferEngine::submit(CURL *handle, Callback done) {
+    {
+        std::lock_guard<std::mutex> guard(queueMutex);
+        ensureWorker();
+        submitted.emplace_back(handle, std::move(done));
+    }
+    curl_multi_wakeup(multi);
+}
+
+std::future<CURLcode> TransferEngine::submit(CURL *handle) {
+    auto promise = std::make_shared<std::promise<CURLcode>>();
+    submit(handle, [promise](CURLcode result, CURL */*handle*/) {
+        promise->set_value(result);
+    });
+    return promise->get_future();
+}
+
+void TransferEngine::loop() {
+    while (!stopped) {
+        // pick up new transfers
+        std::vector<std::pair<CURL *, Callback>> incoming;
+        {
+            std::lock_guard<std::mutex> guard(queueMutex);
+            incoming.swap(submitted);
+        }
+        for (auto &transfer : incoming) {
+            CURLMcode res = curl_multi_add_handle(multi, transfer.first);
+            if (res != CURLM_OK) {
+                transfer.second(CURLE_FAILED_INIT, transfer.first);
+                continue;
+            }
+            running.emplace(transfer.first, std::move(transfer.second));
+        }
+
+        int stillRunning = 0;
+        curl_multi_perform(multi, &stillRunning);
+
+        // dispatch finished transfers
+        int messagesLeft = 0;
+        while (CURLMsg *msg = curl_multi_info_read(multi, &messagesLeft)) {
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+
+            CURL *handle = msg->easy_handle;
+            CURLcode result = msg->data.result;
+            curl_multi_remove_handle(multi, handle);
+
+            auto it = running.find(handle);
+            if (it == running.end())
+                continue;
+
+            Callback done = std::move(it->second);
+            running.erase(it);
+            done(result, handle);
+        }
+
+        // sleep until there's socket activity, timeout or new submission
+        curl_multi_poll(multi, nullptr, 0, 1000, nullptr);
+    }
+
+    // fail whatever is left
+    for (auto &transfer : running) {
+        curl_multi_remove_handle(multi, transfer.first);
+        transfer.second(CURLE_ABORTED_BY_CALLBACK, transfer.first);
+    }
+    running.clear();
+
+    std::lock_guard<std::mutex> guard(queueMutex);
+    for (auto &transfer : submitted) {
+        transfer.second(CURLE_ABORTED_BY_CALLBACK, transfer.first);
+    }
+    submitted.clear();
+}
@@ -0,0 +1,116 @@
+/*****************************************************************************
+ *
+ * Copyright (c) 2018-2020, Oleg `Kanedias` Chernovskiy
+ *
+ * This file is part of MARC-FS.
+ *
+ * MARC-FS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MARC-FS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MARC-FS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRANSFER_ENGINE_H
+#define TRANSFER_ENGINE_H
+
+#include <curl/curl.h>
+
+#include <unistd.h>
+
+#include <functional>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <map>
+
+/**
+ * @brief The TransferEngine class - event loop that runs many cURL transfers at once
+ *        on a single thread via curl_multi interface.
+ *
+ * Unlike @ref MarcRestClient calls, submitted transfers don't block the caller and
+ * don't occupy client from the pool, so hundreds of them may be in flight at once.
+ * Engine doesn't own easy handles, they must stay valid until completion callback is called.
+ *
+ * Event loop thread is started by the first submission, so engine may be created before
+ * FUSE daemonizes. If process forks after the thread was started, child starts its own.
+ *
+ * For now FUSE callbacks still run one blocking call per operation on a pooled client,
+ * engine only parallelizes fan-out inside a call (parts of compound files, share links)
+ * and multiplexes requests of pooled clients. Callbacks don't use it to release their
+ * thread while waiting, and transfers with blocking read/write callbacks are kept off it.
+ *
+ * @see MarcRestClient::removeAsync
+ */
+class TransferEngine
+{
+public:
+    /**
+     * @brief Callback - called on engine thread once transfer is finished,
+     *        handle is already detached from the engine. Must not throw.
+     */
+    using Callback = std::function<void(CURLcode result, CURL *handle)>;
+
+    static TransferEngine & getInstance();
+
+    /**
+     * @brief submit - start transfer on configured easy handle
+     * @param handle - handle to perform
+     * @param done - callback to call on completion
+     */
+    void submit(CURL *handle, Callback done);
+
+    /**
+     * @brief submit - start transfer on configured easy handle
+     * @param handle - handle to perform
+     * @return future that becomes ready with transfer result
+     */
+    std::future<CURLcode> submit(CURL *handle);
+
+    ~TransferEngine();
+
+    TransferEngine(const TransferEngine&) = delete;
+    void operator = (const TransferEngine&) = delete;
+private:
+    TransferEngine();
+
+    /**
+     * @brief loop - event loop, adds submitted handles and dispatches finished ones
+     */
+    void loop();
+
+    /**
+     * @brief ensureWorker - start event loop thread in this process if it's not there yet.
+     *        Must be called with @ref queueMutex held.
+     */
+    void ensureWorker();
+
+    CURLM *multi;
+
+    std::mutex queueMutex;
+    std::vector<std::pair<CURL *, Callback>> submitted;
+
+    /**
+     * @brief running - callbacks of handles attached to multi, accessed by loop thread only
+     */
+    std::map<CURL *, Callback> running;
+
+    std::atomic_bool stopped = false;
+    std::unique_ptr<std::thread> worker;
+
+    /**
+     * @brief workerPid - process @ref worker was started in, threads don't survive fork
+     */
+    pid_t workerPid = 0;
+};
+
+#endif // TRANSFER_ENGINE_H
@@ -21,6 +21,8 @@
 #include "gtest/gtest.h"
 #include "../src/marc_rest_client.h"
 #include "../src/memory_storage.h"
+#include "../src/marc_file_node.h"
+#include "../src/mru_cache.h"
 
 
 MarcRestClient* setUpMrc() {
@@ -231,6 +233,115 @@ TEST(ApiIntegrationTesting, TestCreateNonEmptyBigFile) {
     EXPECT_TRUE(findFileInVec(fVec2, "medium_file.txt") == fVec2.cend());
 }
 
+TEST(ApiIntegrationTesting, TestUploadContentThenAddByHash) {
+    auto mrc = setUpMrc();
+
+    MemoryStorage vpar;
+    vpar.append("There's one for the money, and two for the sin", 46);
+    std::string hash = mrc->uploadContent(vpar, 15, 31); // upload only the tail
+    mrc->addByHash("/hashed_file.txt", hash, 31);
+    auto fVec = mrc->ls("/");
+
+    auto findFileInVec = [&](const auto &vec, std::string arg) {
+        return find_if(vec.cbegin(), vec.cend(), [&arg](auto &f) { return f.getName() == arg; });
+    };
+
+    EXPECT_NE(findFileInVec(fVec, "hashed_file.txt"), fVec.cend());
+    EXPECT_EQ((*findFileInVec(fVec, "hashed_file.txt")).getSize(), 31);
+    EXPECT_EQ((*findFileInVec(fVec, "hashed_file.txt")).getHash(), hash);
+
+    MemoryStorage vpar2;
+    mrc->download("/hashed_file.txt", vpar2);
+    EXPECT_EQ(vpar2.readFully(), " the money, and two for the sin");
+
+    // now delete it not to tamper test env
+    mrc->remove("/hashed_file.txt");
+    auto fVec2 = mrc->ls("/");
+
+    EXPECT_TRUE(findFileInVec(fVec2, "hashed_file.txt") == fVec2.cend());
+}
+
+TEST(ApiIntegrationTesting, TestCopyUnreadFileByHash) {
+    auto mrc = setUpMrc();
+
+    MemoryStorage vpar;
+    vpar.append("There's one for the money, and two for the sin", 46);
+    mrc->upload("/copy_source.txt", vpar);
+
+    auto fVec = mrc->ls("/");
+    auto sourceInfo = find_if(fVec.cbegin(), fVec.cend(), [](auto &f) { return f.getName() == "copy_source.txt"; });
+    ASSERT_NE(sourceInfo, fVec.cend());
+
+    // source is opened the way open() does it, target the way create() does it
+    struct stat sourceStat = {};
+    fillStat(&sourceStat, &*sourceInfo);
+    MarcFileNode source(sourceStat);
+    source.setRemoteHash(sourceInfo->getHash());
+    source.openLazy();
+
+    struct stat targetStat = {};
+    emptyStat(&targetStat, S_IFREG);
+    MarcFileNode target(targetStat);
+    target.openNew();
+
+    // copy is made from the hash alone, source content is never downloaded
+    target.cloneFrom(mrc, "/copy_target.txt", {sourceInfo->getHash()}, sourceInfo->getSize());
+    EXPECT_TRUE(source.needsDownload());
+    EXPECT_EQ(source.getSize(), 46);
+    EXPECT_FALSE(target.isDirty());
+
+    MemoryStorage copied;
+    mrc->download("/copy_target.txt", copied);
+    EXPECT_EQ(copied.readFully(), "There's one for the money, and two for the sin");
+
+    // now delete them not to tamper test env
+    source.release();
+    target.release();
+    mrc->remove("/copy_source.txt");
+    mrc->remove("/copy_target.txt");
+}
+
+TEST(ApiIntegrationTesting, TestDownloadRange) {
+    auto mrc = setUpMrc();
+
+    MemoryStorage vpar;
+    vpar.append("There's one for the money, and two for the sin", 46);
+    mrc->upload("/ranged_file.txt", vpar);
+
+    MemoryStorage vpar2;
+    mrc->download("/ranged_file.txt", vpar2, 0, 25);
+    EXPECT_EQ(vpar2.readFully(), "There's one for the money");
+
+    MemoryStorage vpar3;
+    mrc->download("/ranged_file.txt", vpar3, 35);
+    EXPECT_EQ(vpar3.readFully(), "for the sin");
+
+    // now delete it not to tamper test env
+    mrc->remove("/ranged_file.txt");
+}
+
+TEST(ApiIntegrationTesting, TestAsyncCalls) {
+    auto mrc = setUpMrc();
+
+    MemoryStorage vpar;
+    vpar.append("There's one for the money, and two for the sin", 46);
+    mrc->upload("/async_file.txt", vpar);
+
+    // async share must give the same link as sync one
+    auto sharing = mrc->shareAsync("/async_file.txt");
+    auto link = mrc->share("/async_file.txt");
+    EXPECT_FALSE(link.empty());
+    EXPECT_EQ(sharing.get(), link);
+
+    auto findFileInVec = [&](const auto &vec, std::string arg) {
+        return find_if(vec.cbegin(), vec.cend(), [&arg](auto &f) { return f.getName() == arg; });
+    };
+
+    mrc->removeAsync("/async_file.txt").get();
+    auto fVec2 = mrc->ls("/");
+    EXPECT_TRUE(findFileInVec(fVec2, "async_file.txt") == fVec2.cend());
+}
+
 TEST(ApiIntegrationTesting, TestCreateDir) {
     auto mrc = setUpMrc();
     mrc->mkdir("/testDir");
@@ -0,0 +1,419 @@
+/*****************************************************************************
+ *
+ * Copyright (c) 2018-2020, Oleg `Kanedias` Chernovskiy
+ *
+ * This file is part of MARC-FS.
+ *
+ * MARC-FS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MARC-FS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MARC-FS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "../src/object_pool.h"
+#include "../src/bandwidth_scheduler.h"
+#include "../src/concurrency_limiter.h"
+#include "../src/stream_progress.h"
+#include "../src/retry_policy.h"
+
+using namespace std::chrono_literals;
+
+/**
+ * @brief The Tracked struct - trivial pooled object that counts its live instances
+ *        and detects concurrent use
+ */
+struct Tracked {
+    static std::atomic<int> alive;
+    std::atomic<int> users = {0};
+
+    Tracked() { alive++; }
+    Tracked(const Tracked &) { alive++; }
+    ~Tracked() { alive--; }
+};
+
+std::atomic<int> Tracked::alive = {0};
+
+TEST(ObjectPoolTesting, ConcurrentAcquireRelease) {
+    Tracked prototype;
+    ObjectPool<Tracked> pool;
+    pool.populate(prototype, 2, 4);
+
+    std::atomic<int> shared = {0};
+    std::vector<std::thread> workers;
+    for (int t = 0; t < 8; ++t) {
+        workers.emplace_back([&] {
+            for (int i = 0; i < 10000; ++i) {
+                auto handle = pool.acquire();
+                if (handle->users++ != 0)
+                    shared++;
+                handle->users--;
+            }
+        });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    EXPECT_EQ(shared.load(), 0);
+
+    // all objects are back: whole pool can be taken at once, and they're all different
+    std::vector<ObjectPool<Tracked>::Handle> taken;
+    for (int i = 0; i < 4; ++i) {
+        taken.push_back(pool.acquire());
+    }
+
+    std::vector<Tracked *> objects;
+    for (auto &handle : taken) {
+        objects.push_back(handle.get());
+    }
+    std::sort(objects.begin(), objects.end());
+    EXPECT_EQ(std::unique(objects.begin(), objects.end()), objects.end());
+    EXPECT_LE(Tracked::alive.load(), 1 + 1 + 4); // ours, prototype of the pool and pooled ones
+}
+
+TEST(ObjectPoolTesting, ReserveIsKept) {
+    Tracked prototype;
+    ObjectPool<Tracked> pool;
+    pool.populate(prototype, 1, 3);
+
+    auto first = pool.acquire(1);
+    auto second = pool.acquire(1);
+
+    // one is left, low-priority caller must not take it
+    auto waiting = std::async(std::launch::async, [&] { return pool.acquire(1); });
+    EXPECT_EQ(waiting.wait_for(200ms), std::future_status::timeout);
+
+    // high-priority one does
+    {
+        auto last = pool.acquire();
+        EXPECT_TRUE(last);
+    }
+    EXPECT_EQ(waiting.wait_for(200ms), std::future_status::timeout);
+
+    // returned one makes room for the waiter
+    first.reset();
+    ASSERT_EQ(waiting.wait_for(1s), std::future_status::ready);
+    EXPECT_TRUE(waiting.get());
+}
+
+TEST(ObjectPoolTesting, PopulateWakesWaiters) {
+    Tracked prototype;
+    ObjectPool<Tracked> pool;
+
+    auto waiting = std::async(std::launch::async, [&] { return pool.acquire(); });
+    EXPECT_EQ(waiting.wait_for(200ms), std::future_status::timeout);
+
+    pool.populate(prototype, 1, 2);
+    ASSERT_EQ(waiting.wait_for(1s), std::future_status::ready);
+    EXPECT_TRUE(waiting.get());
+}
+
+TEST(ObjectPoolTesting, IdleObjectsAreDestroyed) {
+    Tracked prototype;
+    ObjectPool<Tracked> pool;
+    pool.populate(prototype, 1, 4, 50ms);
+    int base = Tracked::alive.load(); // ours, prototype of the pool and minimal one
+
+    {
+        // take all, so missing ones are created
+        std::vector<ObjectPool<Tracked>::Handle> taken;
+        for (int i = 0; i < 4; ++i) {
+            taken.push_back(pool.acquire());
+        }
+        EXPECT_EQ(Tracked::alive.load(), base + 3);
+    }
+
+    // returned objects are kept for a while
+    EXPECT_EQ(Tracked::alive.load(), base + 3);
+
+    // next return after timeout destroys the idle ones, down to minimal size
+    std::this_thread::sleep_for(100ms);
+    pool.acquire().reset();
+    EXPECT_EQ(Tracked::alive.load(), base);
+
+    // and they're created again when needed
+    std::vector<ObjectPool<Tracked>::Handle> taken;
+    for (int i = 0; i < 4; ++i) {
+        taken.push_back(pool.acquire());
+    }
+    EXPECT_EQ(Tracked::alive.load(), base + 3);
+}
+
+TEST(RetryPolicyTesting, RetriesOnlyTransientFailures) {
+    RetryPolicy policy;
+    policy.maxRetries = 2;
+
+    EXPECT_TRUE(policy.shouldRetry(TransportException("connection reset"), 0));
+    EXPECT_TRUE(policy.shouldRetry(TransferStalledException(), 0));
+    EXPECT_TRUE(policy.shouldRetry(MailApiException("throttled", 429), 0));
+    EXPECT_TRUE(policy.shouldRetry(MailApiException("server error", 503), 1));
+
+    EXPECT_FALSE(policy.shouldRetry(MailApiException("not found", 404), 0));
+    EXPECT_FALSE(policy.shouldRetry(MailApiException("unparsable answer"), 0));
+    EXPECT_FALSE(policy.shouldRetry(CircuitOpenException("https://cloud.mail.ru/api/v2/file"), 0));
+
+    // budget is used up
+    EXPECT_FALSE(policy.shouldRetry(MailApiException("server error", 503), 2));
+}
+
+TEST(RetryPolicyTesting, NonIdempotentCallsRetryOnlyThrottling) {
+    RetryPolicy policy;
+
+    EXPECT_TRUE(policy.shouldRetry(MailApiException("throttled", 429), 0, false));
+    EXPECT_FALSE(policy.shouldRetry(MailApiException("server error", 500), 0, false));
+    EXPECT_FALSE(policy.shouldRetry(TransportException("connection reset"), 0, false));
+}
+
+TEST(RetryPolicyTesting, BackoffGrowsWithinBounds) {
+    RetryPolicy policy;
+    policy.baseDelay = 100ms;
+    policy.maxDelay = 1s;
+
+    for (int i = 0; i < 100; ++i) {
+        EXPECT_LE(policy.backoff(0), 100ms);
+        EXPECT_LE(policy.backoff(2), 400ms);
+        EXPECT_LE(policy.backoff(50), 1s);
+        EXPECT_GE(policy.backoff(50), 0ms);
+    }
+}
+
+TEST(CircuitBreakerTesting, OpensAfterConsecutiveFailures) {
+    CircuitBreaker breaker(1h);
+    const std::string endpoint = "https://cloud.mail.ru/api/v2/folder";
+
+    for (int i = 0; i < 4; ++i) {
+        EXPECT_TRUE(breaker.allow(endpoint));
+        breaker.record(endpoint, i % 2 ? 0 : 502); // transport errors count as well
+    }
+
+    // answer, even with error, proves endpoint is alive
+    breaker.record(endpoint, 404);
+    for (int i = 0; i < 4; ++i) {
+        breaker.record(endpoint, 500);
+    }
+    EXPECT_TRUE(breaker.allow(endpoint));
+
+    breaker.record(endpoint, 500);
+    EXPECT_FALSE(breaker.allow(endpoint));
+
+    // other endpoints are not affected
+    EXPECT_TRUE(breaker.allow("https://cloud.mail.ru/api/v2/file"));
+}
+
+TEST(CircuitBreakerTesting, SingleProbeAfterCooldown) {
+    CircuitBreaker breaker(50ms);
+    const std::string endpoint = "https://cloud.mail.ru/api/v2/folder";
+    for (int i = 0; i < 5; ++i) {
+        breaker.record(endpoint, 503);
+    }
+    EXPECT_FALSE(breaker.allow(endpoint));
+
+    // half-open: one call goes through, others wait for its outcome
+    std::this_thread::sleep_for(100ms);
+    EXPECT_TRUE(breaker.allow(endpoint));
+    EXPECT_FALSE(breaker.allow(endpoint));
+
+    // failed probe opens it again for the whole cooldown
+    breaker.record(endpoint, 503);
+    EXPECT_FALSE(breaker.allow(endpoint));
+
+    // successful probe closes it
+    std::this_thread::sleep_for(100ms);
+    EXPECT_TRUE(breaker.allow(endpoint));
+    breaker.record(endpoint, 200);
+    EXPECT_TRUE(breaker.allow(endpoint));
+    EXPECT_TRUE(breaker.allow(endpoint));
+}
+
+TEST(BandwidthSchedulerTesting, TotalRateIsCapped) {
+    auto &scheduler = BandwidthScheduler::getInstance();
+    scheduler.setRate(BandwidthScheduler::Direction::DOWNLOAD, 1 << 20);
+
+    // 4 transfers of 128 KiB each share 1 MiB/s, so it takes about half a second
+    auto started = std::chrono::steady_clock::now();
+    std::vector<std::thread> transfers;
+    for (int t = 0; t < 4; ++t) {
+        transfers.emplace_back([&] {
+            BandwidthScheduler::Flow flow;
+            for (int i = 0; i < 8; ++i) {
+                scheduler.consume(BandwidthScheduler::Direction::DOWNLOAD, flow, 16 << 10);
+            }
+        });
+    }
+    for (auto &transfer : transfers) {
+        transfer.join();
+    }
+    auto elapsed = std::chrono::steady_clock::now() - started;
+    scheduler.setRate(BandwidthScheduler::Direction::DOWNLOAD, 0);
+
+    EXPECT_GE(elapsed, 400ms);
+    EXPECT_LE(elapsed, 800ms);
+}
+
+TEST(BandwidthSchedulerTesting, RateIsSharedByWeight) {
+    auto &scheduler = BandwidthScheduler::getInstance();
+    scheduler.setRate(BandwidthScheduler::Direction::UPLOAD, 1 << 20);
+
+    // both transfer for a second, heavier one must get twice the bytes
+    std::atomic_bool stop = false;
+    auto transfer = [&](double weight) {
+        BandwidthScheduler::Priority priority(weight);
+        BandwidthScheduler::Flow flow;
+        size_t transferred = 0;
+        while (!stop) {
+            scheduler.consume(BandwidthScheduler::Direction::UPLOAD, flow, 8 << 10);
+            transferred += 8 << 10;
+        }
+        return transferred;
+    };
+    auto heavy = std::async(std::launch::async, transfer, 2.0);
+    auto light = std::async(std::launch::async, transfer, 1.0);
+    std::this_thread::sleep_for(1s);
+    stop = true;
+
+    double ratio = static_cast<double>(heavy.get()) / light.get();
+    scheduler.setRate(BandwidthScheduler::Direction::UPLOAD, 0);
+
+    EXPECT_GE(ratio, 1.6);
+    EXPECT_LE(ratio, 2.5);
+}
+
+/**
+ * @brief pass - pass @param count requests through @param limiter
+ */
+static void pass(ConcurrencyLimiter &limiter, int count, std::chrono::milliseconds latency, bool overloaded = false) {
+    for (int i = 0; i < count; ++i) {
+        limiter.acquire();
+        limiter.release(latency, overloaded);
+    }
+}
+
+TEST(ConcurrencyLimiterTesting, IncreasesAdditivelyUpToMaximum) {
+    ConcurrencyLimiter limiter(1, 10, 4, false);
+
+    // about one more per limit's worth of successes
+    pass(limiter, 5, 100ms);
+    EXPECT_EQ(limiter.getLimit(), 5u);
+    pass(limiter, 5, 100ms);
+    EXPECT_EQ(limiter.getLimit(), 6u);
+
+    pass(limiter, 1000, 100ms);
+    EXPECT_EQ(limiter.getLimit(), 10u);
+}
+
+TEST(ConcurrencyLimiterTesting, DecreasesMultiplicativelyDownToMinimum) {
+    ConcurrencyLimiter limiter(2, 20, 16, false);
+
+    pass(limiter, 1, 100ms, true);
+    EXPECT_EQ(limiter.getLimit(), 8u);
+
+    // failures of one burst cut it only once
+    pass(limiter, 3, 100ms, true);
+    EXPECT_EQ(limiter.getLimit(), 8u);
+
+    for (int i = 0; i < 4; ++i) {
+        std::this_thread::sleep_for(1100ms);
+        pass(limiter, 1, 100ms, true);
+    }
+    EXPECT_EQ(limiter.getLimit(), 2u);
+}
+
+TEST(ConcurrencyLimiterTesting, RisingLatencyMeansOverload) {
+    ConcurrencyLimiter limiter(1, 20, 10, true);
+    pass(limiter, 50, 10ms);
+    size_t limit = limiter.getLimit();
+
+    pass(limiter, 20, 100ms);
+    EXPECT_LT(limiter.getLimit(), limit);
+
+    // latency doesn't matter for insensitive one
+    ConcurrencyLimiter insensitive(1, 20, 10, false);
+    pass(insensitive, 50, 10ms);
+    limit = insensitive.getLimit();
+    pass(insensitive, 20, 100ms);
+    EXPECT_GE(insensitive.getLimit(), limit);
+}
+
+TEST(ConcurrencyLimiterTesting, RequestsWaitAboveLimit) {
+    ConcurrencyLimiter limiter(1, 2, 2, false);
+    limiter.acquire();
+    limiter.acquire();
+
+    auto waiting = std::async(std::launch::async, [&] { limiter.acquire(); });
+    EXPECT_EQ(waiting.wait_for(200ms), std::future_status::timeout);
+
+    // requests that must not wait are counted anyway
+    limiter.acquire(false);
+
+    limiter.release(100ms, false);
+    EXPECT_EQ(waiting.wait_for(200ms), std::future_status::timeout);
+    limiter.release(100ms, false);
+    EXPECT_EQ(waiting.wait_for(1s), std::future_status::ready);
+
+    limiter.release(100ms, false);
+    limiter.release(100ms, false);
+}
+
+TEST(StreamProgressTesting, ReaderFollowsWriter) {
+    StreamProgress progress;
+    progress.advance(100);
+    EXPECT_EQ(progress.waitBeyond(0), 100);
+    EXPECT_EQ(progress.waitBeyond(50), 100);
+
+    // nothing beyond what's written yet, reader waits
+    auto waiting = std::async(std::launch::async, [&] { return progress.waitBeyond(100); });
+    EXPECT_EQ(waiting.wait_for(200ms), std::future_status::timeout);
+
+    progress.advance(150);
+    ASSERT_EQ(waiting.wait_for(1s), std::future_status::ready);
+    EXPECT_EQ(waiting.get(), 150);
+
+    // writer never goes back
+    progress.advance(120);
+    EXPECT_EQ(progress.waitBeyond(0), 150);
+}
+
+TEST(StreamProgressTesting, CloseLetsReaderFinish) {
+    StreamProgress progress;
+    progress.advance(100);
+
+    auto waiting = std::async(std::launch::async, [&] { return progress.waitBeyond(100); });
+    EXPECT_EQ(waiting.wait_for(200ms), std::future_status::timeout);
+
+    progress.close();
+    ASSERT_EQ(waiting.wait_for(1s), std::future_status::ready);
+    EXPECT_EQ(waiting.get(), 100); // nothing more
+
+    // announced bytes are still there
+    EXPECT_EQ(progress.waitBeyond(20), 100);
+    EXPECT_FALSE(progress.isAborted());
+}
+
+TEST(StreamProgressTesting, AbortWakesReader) {
+    StreamProgress progress;
+    progress.advance(100);
+
+    auto waiting = std::async(std::launch::async, [&] { return progress.waitBeyond(100); });
+    EXPECT_EQ(waiting.wait_for(200ms), std::future_status::timeout);
+
+    progress.abort();
+    ASSERT_EQ(waiting.wait_for(1s), std::future_status::ready);
+    EXPECT_EQ(waiting.get(), -1);
+    EXPECT_EQ(progress.waitBeyond(0), -1);
+    EXPECT_TRUE(progress.isAborted());
+}